@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Replay the recorded corpora through each driver, first in real time (for
+# the latency histograms) and then as fast as possible (for throughput and CPU
+# cost per event). MIDI output is counted but not sent, so no ALSA
+# sequencer (or the hardware) is needed.
+#
+# usage: bench.sh [times-over-for-fast-replay]
+
+cd "$(dirname "$0")/.." || exit 1
+
+FAST=${1:-200}
+
+run ()
+{
+	name=$1; shift
+
+	echo "== $name (real time)"
+	"$@" 2>&1 >/dev/null | sed -n '/^Replayed/,$p'
+
+	echo "== $name (fast x$FAST)"
+	"$@" -F "$FAST" 2>&1 >/dev/null | grep '^Replayed'
+
+	echo
+}
+
+run monterey ./lsmi-monterey -P bench/monterey-mix.rec
+run joystick ./lsmi-joystick -P bench/joystick-sweep.rec
+run joystick-evdev ./lsmi-joystick -P bench/joystick-frames.rec
+run gamepad ./lsmi-gamepad-toggle-cc -k bench/gamepad.keydb -P bench/gamepad-toggle.rec
+run keyhack ./lsmi-keyhack -k bench/keyhack.keydb -P bench/keyhack-glissando.rec
@@ -0,0 +1,497 @@
+/* iobench.c
+ *
+ * Compare the ways of reading several input devices at high event rates:
+ *
+ * 	read	a process per device, one read() per event, as the drivers
+ * 		used to
+ * 	epoll	one process, epoll_wait() then a read() of everything each
+ * 		ready device has (the main loop's default)
+ * 	uring	one process, reads kept armed on an io_uring (ring.c, as built
+ * 		with IO_URING=1)
+ *
+ * The devices are synthetic: uinput devices when /dev/uinput can be opened,
+ * pipes carrying the same events otherwise (or with -p). Each is fed by a
+ * child writing frames of an axis, a button and a SYN_REPORT as fast as it
+ * can. Reported are events read (a uinput device drops what a slow reader
+ * can't keep up with), throughput, reader CPU and syscalls per event.
+ *
+ * usage: iobench [-p] [devices [frames-per-device]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/cdefs.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "loop.h"
+#include "ring.h"
+
+#define MAX_DEVS 16
+#define BATCH 64									/* events per read() */
+
+/* what a reader did, in shared memory */
+struct stats_s {
+	unsigned long events;
+	unsigned long calls;							/* syscalls */
+	double last;									/* when the last event came in */
+};
+
+struct dev_s {
+	int rfd;
+	int wfd;
+	int open;
+	struct input_event buf[ BATCH ];
+};
+
+static struct dev_s devs[ MAX_DEVS ];
+static int ndevs = 4;
+static long frames = 100000;
+static int use_uinput = 1;
+static struct stats_s *stats;
+
+/* ring.c's hook into the main loop, which here is just a poll() */
+static int loop_fd = -1;
+static watch_f loop_f;
+
+int
+watch_fd ( int fd, watch_f f, void *arg )
+{
+	loop_fd = fd;
+	loop_f = f;
+
+	return 0;
+}
+
+static double
+now ( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Find the event node of the uinput device on /ufd/ and open it
+ */
+static int
+open_uinput_node ( int ufd )
+{
+	char sys[ 64 ], path[ 300 ];
+	struct dirent *de;
+	DIR *dir;
+	int i, fd = -1;
+
+	if ( ioctl( ufd, UI_GET_SYSNAME( sizeof( sys ) ), sys ) < 0 )
+		return -1;
+
+	snprintf( path, sizeof( path ), "/sys/devices/virtual/input/%s", sys );
+
+	if ( NULL == ( dir = opendir( path ) ) )
+		return -1;
+
+	while ( ( de = readdir( dir ) ) )
+		if ( ! strncmp( de->d_name, "event", 5 ) )
+			break;
+
+	if ( de )
+	{
+		snprintf( path, sizeof( path ), "/dev/input/%s", de->d_name );
+
+		/* udev may not have made the node yet */
+		for ( i = 0; i < 100 && fd < 0; i++ )
+			if ( ( fd = open( path, O_RDONLY ) ) < 0 )
+				usleep( 10000 );
+	}
+
+	closedir( dir );
+
+	return fd;
+}
+
+/**
+ * Create uinput device /d/, returning -1 if uinput isn't available
+ */
+static int
+create_uinput ( struct dev_s *d, int n )
+{
+	struct uinput_user_dev uidev;
+
+	if ( -1 == ( d->wfd = open( "/dev/uinput", O_WRONLY ) ) &&
+		 -1 == ( d->wfd = open( "/dev/input/uinput", O_WRONLY ) ) )
+		return -1;
+
+	memset( &uidev, 0, sizeof( uidev ) );
+	snprintf( uidev.name, sizeof( uidev.name ), "lsmi iobench %d", n );
+	uidev.id.bustype = BUS_VIRTUAL;
+	uidev.absmax[ ABS_X ] = 255;
+
+	ioctl( d->wfd, UI_SET_EVBIT, EV_KEY );
+	ioctl( d->wfd, UI_SET_EVBIT, EV_ABS );
+	ioctl( d->wfd, UI_SET_KEYBIT, BTN_A );
+	ioctl( d->wfd, UI_SET_ABSBIT, ABS_X );
+
+	if ( write( d->wfd, &uidev, sizeof( uidev ) ) != sizeof( uidev ) ||
+		 ioctl( d->wfd, UI_DEV_CREATE, 0 ) < 0 ||
+		 ( d->rfd = open_uinput_node( d->wfd ) ) < 0 )
+	{
+		close( d->wfd );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Make fresh devices to read, or reuse the uinput ones
+ */
+static void
+open_devices ( void )
+{
+	int i, p[2];
+
+	for ( i = 0; i < ndevs; i++ )
+	{
+		devs[i].open = 1;
+
+		if ( use_uinput )
+		{
+			if ( devs[i].rfd > 0 || create_uinput( &devs[i], i ) == 0 )
+				continue;
+
+			fprintf( stderr, "No uinput, using pipes instead\n" );
+			use_uinput = 0;
+		}
+
+		if ( pipe( p ) < 0 )
+		{
+			perror( "pipe()" );
+			exit( 1 );
+		}
+
+		devs[i].rfd = p[0];
+		devs[i].wfd = p[1];
+	}
+}
+
+/**
+ * Close the ends of the devices a child doesn't use: all the write ends but
+ * /writer/'s, and all the read ends but /reader/'s (-1 for none, -2 for all)
+ */
+static void
+close_others ( int reader, int writer )
+{
+	int i;
+
+	for ( i = 0; i < ndevs; i++ )
+	{
+		if ( reader != -2 && i != reader )
+			close( devs[i].rfd );
+		if ( i != writer )
+			close( devs[i].wfd );
+	}
+}
+
+/**
+ * Feed device /n/ as fast as it will take it
+ */
+static void
+feed ( int n )
+{
+	struct input_event ev[3];
+	long i;
+
+	memset( ev, 0, sizeof( ev ) );
+	ev[0].type = EV_ABS;
+	ev[0].code = ABS_X;
+	ev[1].type = EV_KEY;
+	ev[1].code = BTN_A;
+	ev[2].type = EV_SYN;
+	ev[2].code = SYN_REPORT;
+
+	for ( i = 0; i < frames; i++ )
+	{
+		ev[0].value = i & 255;
+		ev[1].value = i & 1;
+
+		if ( write( devs[n].wfd, ev, sizeof( ev ) ) != sizeof( ev ) )
+			break;
+	}
+}
+
+/**
+ * Count /n/ bytes read into stats /s/
+ */
+static void
+took ( struct stats_s *s, int n )
+{
+	s->events += n / sizeof( struct input_event );
+	s->last = now();
+}
+
+/**
+ * One read() per event from device /n/
+ */
+static void
+read_one ( int n, struct stats_s *s )
+{
+	struct input_event ev;
+	long want = frames * 3;
+	int r;
+
+	while ( s->events < want )
+	{
+		s->calls++;
+
+		if ( ( r = read( devs[n].rfd, &ev, sizeof( ev ) ) ) <= 0 )
+			break;
+
+		took( s, r );
+	}
+}
+
+/**
+ * epoll_wait(), then read everything each ready device has
+ */
+static void
+read_epoll ( struct stats_s *s )
+{
+	struct epoll_event ee[ MAX_DEVS ];
+	long want = frames * 3 * ndevs;
+	int i, n, r, epfd, open = ndevs;
+
+	epfd = epoll_create1( 0 );
+
+	for ( i = 0; i < ndevs; i++ )
+	{
+		ee[0].events = EPOLLIN;
+		ee[0].data.ptr = &devs[i];
+		epoll_ctl( epfd, EPOLL_CTL_ADD, devs[i].rfd, &ee[0] );
+	}
+
+	while ( open && s->events < want )
+	{
+		s->calls++;
+
+		if ( ( n = epoll_wait( epfd, ee, MAX_DEVS, -1 ) ) < 0 )
+			break;
+
+		for ( i = 0; i < n; i++ )
+		{
+			struct dev_s *d = ee[i].data.ptr;
+
+			s->calls++;
+
+			if ( ( r = read( d->rfd, d->buf, sizeof( d->buf ) ) ) <= 0 )
+			{
+				epoll_ctl( epfd, EPOLL_CTL_DEL, d->rfd, NULL );
+				open--;
+				continue;
+			}
+
+			took( s, r );
+		}
+	}
+}
+
+static void *
+ring_buf ( void *arg, size_t *len )
+{
+	struct dev_s *d = arg;
+
+	*len = sizeof( d->buf );
+
+	return d->buf;
+}
+
+static void
+ring_done ( int res, void *arg )
+{
+	struct dev_s *d = arg;
+
+	if ( res <= 0 )
+	{
+		ring_unwatch( d->rfd );
+		d->open = 0;
+		return;
+	}
+
+	took( stats, res );
+}
+
+/**
+ * Reads kept armed on the ring, harvested after each wakeup
+ */
+static void
+read_uring ( struct stats_s *s )
+{
+	struct pollfd p;
+	long want = frames * 3 * ndevs;
+	int i, open;
+
+	for ( i = 0; i < ndevs; i++ )
+		if ( ring_watch( devs[i].rfd, ring_buf, ring_done, &devs[i] ) < 0 )
+		{
+			fprintf( stderr, "No io_uring here!\n" );
+			return;
+		}
+
+	p.fd = loop_fd;
+	p.events = POLLIN;
+
+	for ( ;; )
+	{
+		for ( open = i = 0; i < ndevs; i++ )
+			open += devs[i].open;
+
+		if ( ! open || s->events >= want )
+			break;
+
+		ring_submit();
+
+		s->calls++;
+
+		if ( poll( &p, 1, -1 ) < 0 )
+			break;
+
+		loop_f( loop_fd, NULL );
+	}
+
+	s->calls += ring_enters;
+}
+
+/**
+ * Read all the devices in /mode/ while they're fed, and print how it went
+ */
+static void
+bench ( const char *mode )
+{
+	pid_t readers[ MAX_DEVS ], writers[ MAX_DEVS ];
+	int i, nreaders = strcmp( mode, "read" ) ? 1 : ndevs;
+	struct stats_s total;
+	double start, cpu = 0;
+
+	open_devices();
+
+	memset( stats, 0, sizeof( struct stats_s ) * MAX_DEVS );
+
+	start = now();
+
+	for ( i = 0; i < nreaders; i++ )
+		if ( 0 == ( readers[i] = fork() ) )
+		{
+			close_others( nreaders > 1 ? i : -2, -1 );
+
+			if ( ! strcmp( mode, "read" ) )
+				read_one( i, &stats[i] );
+			else if ( ! strcmp( mode, "epoll" ) )
+				read_epoll( &stats[i] );
+			else
+			{
+				stats = &stats[i];
+				read_uring( stats );
+			}
+
+			_exit( 0 );
+		}
+
+	for ( i = 0; i < ndevs; i++ )
+		if ( 0 == ( writers[i] = fork() ) )
+		{
+			close_others( -1, i );
+			feed( i );
+			_exit( 0 );
+		}
+
+	/* pipes are made afresh each run, so the readers see EOF */
+	if ( ! use_uinput )
+		close_others( -1, -1 );
+
+	for ( i = 0; i < ndevs; i++ )
+		waitpid( writers[i], NULL, 0 );
+
+	/* a uinput reader waits forever for whatever was dropped */
+	if ( use_uinput )
+		usleep( 200000 );
+
+	memset( &total, 0, sizeof( total ) );
+
+	for ( i = 0; i < nreaders; i++ )
+	{
+		struct rusage ru;
+
+		if ( use_uinput )
+			kill( readers[i], SIGTERM );
+		wait4( readers[i], NULL, 0, &ru );
+
+		cpu += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+			   ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+
+		total.events += stats[i].events;
+		total.calls += stats[i].calls;
+		if ( stats[i].last > total.last )
+			total.last = stats[i].last;
+	}
+
+	if ( ! total.events )
+	{
+		printf( "%-6s nothing read\n", mode );
+		return;
+	}
+
+	printf( "%-6s %lu of %lu events in %.3f s: %.0f events/s, %.0f nS CPU/event, %.3f syscalls/event\n",
+			mode, total.events, frames * 3 * ndevs, total.last - start,
+			total.events / ( total.last - start ), cpu * 1e9 / total.events,
+			(double)total.calls / total.events );
+}
+
+int
+main ( int argc, char **argv )
+{
+	if ( argc > 1 && ! strcmp( argv[1], "-p" ) )
+	{
+		use_uinput = 0;
+		argc--, argv++;
+	}
+
+	if ( argc > 1 )
+		ndevs = atoi( argv[1] );
+	if ( argc > 2 )
+		frames = atol( argv[2] );
+
+	if ( ndevs < 1 || ndevs > MAX_DEVS || frames < 1 )
+	{
+		fprintf( stderr, "usage: iobench [-p] [devices (1-%d) [frames-per-device]]\n", MAX_DEVS );
+		exit( 1 );
+	}
+
+	stats = mmap( NULL, sizeof( struct stats_s ) * MAX_DEVS, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+
+	signal( SIGPIPE, SIG_IGN );
+
+	printf( "%d devices, %ld frames (%ld events) each\n", ndevs, frames, frames * 3 );
+
+	bench( "read" );
+	bench( "epoll" );
+	bench( "uring" );
+
+	return 0;
+}
@@ -0,0 +1,441 @@
+/* mkcorpus.c
+ *
+ * Generate the benchmark corpora replayed by bench.sh (see replay.c for the
+ * recording format). These stand in for real sessions, so the numbers are
+ * repeatable on machines without the hardware.
+ *
+ * 	monterey-mix.rec	typing interleaved with velocity sensitive playing
+ * 	joystick-sweep.rec	pitchbend and modulation sweeps with jitter, then
+ * 				a stick held still (but jittering)
+ * 	joystick-frames.rec	the same through the event interface, with both
+ * 				axes reported in each frame
+ * 	gamepad-toggle.rec	a gamepad's buttons toggled in turn
+ * 	gamepad.keydb		key database for the above
+ * 	keyhack-glissando.rec	88 key glissandi, up and down
+ * 	keyhack.keydb		key database for the above
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <linux/input.h>
+#include <linux/joystick.h>
+
+#include "keydb.h"
+
+#define REC_EVDEV 1
+#define REC_JS 2
+
+struct rec_header_s {
+	char magic[4];
+	uint8_t version;
+	uint8_t kind;
+	uint16_t reserved;
+};
+
+struct rec_evdev_s {
+	uint32_t delta;
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+};
+
+struct rec_js_s {
+	uint32_t delta;
+	int16_t value;
+	uint8_t type;
+	uint8_t number;
+};
+
+static FILE *out;
+static uint32_t pending;							/* uS before next event */
+
+static void
+start ( const char *file, int kind )
+{
+	struct rec_header_s h = { "LSMR", 1, 0, 0 };
+
+	if ( NULL == ( out = fopen( file, "w" ) ) )
+	{
+		perror( file );
+		exit( 1 );
+	}
+
+	h.kind = kind;
+	fwrite( &h, sizeof( h ), 1, out );
+	pending = 0;
+
+	/* each corpus the same, whatever the others do */
+	srand( 1 );
+}
+
+static void
+wait_us ( uint32_t us )
+{
+	pending += us;
+}
+
+static void
+ev ( int type, int code, int value )
+{
+	struct rec_evdev_s r;
+
+	r.delta = pending;
+	r.type = type;
+	r.code = code;
+	r.value = value;
+
+	fwrite( &r, sizeof( r ), 1, out );
+	pending = 0;
+}
+
+static void
+js ( int type, int number, int value )
+{
+	struct rec_js_s r;
+
+	r.delta = pending;
+	r.value = value;
+	r.type = type;
+	r.number = number;
+
+	fwrite( &r, sizeof( r ), 1, out );
+	pending = 0;
+}
+
+/* a keyboard frame: scancode, key, SYN_REPORT */
+static void
+key_frame ( int code, int value )
+{
+	ev( EV_MSC, MSC_SCAN, code );
+	ev( EV_KEY, code, value );
+	ev( EV_SYN, SYN_REPORT, 0 );
+}
+
+/* --- monterey --- */
+
+static const int keylist[] = {
+	  KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J,
+	  KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T,
+	  KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z, KEY_8, KEY_9, KEY_MINUS,
+	  KEY_EQUAL, KEY_BACKSLASH, KEY_LEFTBRACE, KEY_RIGHTBRACE, KEY_SEMICOLON,
+	  KEY_APOSTROPHE, KEY_COMMA, KEY_DOT,
+};
+
+static const int numlist[] = {
+  KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7,
+};
+
+/* the musical keyboard sends the key, then its velocity ~2.5mS later */
+static void
+note ( int key, int velocity )
+{
+	key_frame( keylist[ key ], 1 );
+	wait_us( 2500 );
+	key_frame( numlist[ velocity ], 1 );
+}
+
+static void
+type_text ( const char *s )
+{
+	static const int letters[] = {
+		KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J,
+		KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T,
+		KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z,
+	};
+
+	for ( ; *s; s++ )
+	{
+		int code = *s == ' ' ? KEY_SPACE : letters[ *s - 'a' ];
+
+		key_frame( code, 1 );
+		wait_us( 50000 + rand() % 30000 );
+		key_frame( code, 0 );
+		wait_us( 20000 + rand() % 40000 );
+	}
+}
+
+static void
+play_phrase ( int notes )
+{
+	int i;
+
+	for ( i = 0; i < notes; i++ )
+	{
+		/* triads, walking up and down the keyboard */
+		int root = ( i * 5 ) % 30;
+		int v = 1 + rand() % 7;
+
+		note( root, v );
+		wait_us( 1000 + rand() % 3000 );
+		note( root + 4, v );
+		wait_us( 1000 + rand() % 3000 );
+		note( root + 7, v );
+
+		wait_us( 120000 + rand() % 60000 );
+
+		note( root, 0 );
+		note( root + 4, 0 );
+		note( root + 7, 0 );
+
+		wait_us( 20000 + rand() % 20000 );
+	}
+}
+
+static void
+monterey ( void )
+{
+	start( "monterey-mix.rec", REC_EVDEV );
+
+	type_text( "the quick brown fox" );
+	play_phrase( 8 );
+	type_text( "jumps over the lazy dog" );
+	play_phrase( 8 );
+
+	fclose( out );
+}
+
+/* --- joystick --- */
+
+static void
+sweep ( int axis, int from, int to )
+{
+	int step = from < to ? 600 : -600;
+	int v;
+
+	for ( v = from; step > 0 ? v < to : v > to; v += step )
+	{
+		js( JS_EVENT_AXIS, axis, v + rand() % 7 - 3 );
+		wait_us( 4000 + rand() % 2000 );
+	}
+}
+
+static void
+joystick ( void )
+{
+	int i;
+
+	start( "joystick-sweep.rec", REC_JS );
+
+	/* pitchbend */
+	js( JS_EVENT_BUTTON, 0, 1 );
+	sweep( 1, 0, 32767 );
+	sweep( 1, 32767, -32767 );
+	sweep( 1, -32767, 0 );
+	js( JS_EVENT_BUTTON, 0, 0 );
+	wait_us( 200000 );
+
+	/* modulation */
+	js( JS_EVENT_BUTTON, 1, 1 );
+	sweep( 1, 0, -32767 );
+	sweep( 1, -32767, 0 );
+	js( JS_EVENT_BUTTON, 1, 0 );
+	wait_us( 200000 );
+
+	/* both */
+	js( JS_EVENT_BUTTON, 0, 1 );
+	js( JS_EVENT_BUTTON, 1, 1 );
+	sweep( 0, 0, 32767 );
+	sweep( 1, 0, 32767 );
+	sweep( 0, 32767, 0 );
+	sweep( 1, 32767, 0 );
+	js( JS_EVENT_BUTTON, 1, 0 );
+	js( JS_EVENT_BUTTON, 0, 0 );
+	wait_us( 200000 );
+
+	/* held still, with pitchbend on */
+	js( JS_EVENT_BUTTON, 0, 1 );
+	sweep( 1, 0, 12000 );
+	for ( i = 0; i < 200; i++ )
+	{
+		js( JS_EVENT_AXIS, 1, 12000 + rand() % 7 - 3 );
+		wait_us( 4000 + rand() % 2000 );
+	}
+	js( JS_EVENT_BUTTON, 0, 0 );
+
+	fclose( out );
+}
+
+/* a joystick frame: both axes, SYN_REPORT */
+static void
+abs_frame ( int x, int y )
+{
+	ev( EV_ABS, ABS_X, x );
+	ev( EV_ABS, ABS_Y, y );
+	ev( EV_SYN, SYN_REPORT, 0 );
+}
+
+static void
+button_frame ( int code, int value )
+{
+	ev( EV_KEY, code, value );
+	ev( EV_SYN, SYN_REPORT, 0 );
+}
+
+/* both axes at once, x from /x0/ to /x1/ as y goes from /from/ to /to/ */
+static void
+sweep_frames ( int x0, int x1, int from, int to )
+{
+	int n = abs( to - from ) / 600;
+	int i;
+
+	for ( i = 0; i < n; i++ )
+	{
+		abs_frame( x0 + ( x1 - x0 ) * i / n + rand() % 7 - 3,
+				   from + ( to - from ) * i / n + rand() % 7 - 3 );
+		wait_us( 4000 + rand() % 2000 );
+	}
+}
+
+static void
+joystick_frames ( void )
+{
+	int i;
+
+	start( "joystick-frames.rec", REC_EVDEV );
+
+	/* pitchbend, the other axis wandering */
+	button_frame( BTN_TRIGGER, 1 );
+	sweep_frames( 0, 3000, 0, 32767 );
+	sweep_frames( 3000, -3000, 32767, -32767 );
+	sweep_frames( -3000, 0, -32767, 0 );
+	button_frame( BTN_TRIGGER, 0 );
+	wait_us( 200000 );
+
+	/* pitchbend and modulation together */
+	button_frame( BTN_TRIGGER, 1 );
+	button_frame( BTN_THUMB, 1 );
+	sweep_frames( 0, 32767, 0, -32767 );
+	sweep_frames( 32767, 0, -32767, 0 );
+	button_frame( BTN_THUMB, 0 );
+	button_frame( BTN_TRIGGER, 0 );
+	wait_us( 200000 );
+
+	/* held still, with pitchbend on */
+	button_frame( BTN_TRIGGER, 1 );
+	sweep_frames( 0, 0, 0, 12000 );
+	for ( i = 0; i < 200; i++ )
+	{
+		abs_frame( rand() % 7 - 3, 12000 + rand() % 7 - 3 );
+		wait_us( 4000 + rand() % 2000 );
+	}
+	button_frame( BTN_TRIGGER, 0 );
+
+	fclose( out );
+}
+
+/* --- gamepad --- */
+
+#define CKEY_EXIT 1
+#define CKEY_NUMERIC 2
+#define SND_SEQ_EVENT_NOTE 5
+#define SND_SEQ_EVENT_CONTROLLER 10
+
+static void
+gamepad ( void )
+{
+	struct keydb_entry_s map[ 9 ];
+	int i, j;
+
+	memset( map, 0, sizeof( map ) );
+
+	for ( i = 0; i < 8; i++ )
+	{
+		map[i].code = BTN_SOUTH + i;
+		map[i].control = CKEY_NUMERIC;
+		map[i].ev_type = SND_SEQ_EVENT_CONTROLLER;
+		map[i].number = 13 + i;
+	}
+
+	map[8].code = BTN_MODE;
+	map[8].control = CKEY_EXIT;
+
+	if ( keydb_save( "gamepad.keydb", KEYDB_GAMEPAD, map, 9 ) < 0 )
+	{
+		perror( "gamepad.keydb" );
+		exit( 1 );
+	}
+
+	start( "gamepad-toggle.rec", REC_EVDEV );
+
+	for ( j = 0; j < 10; j++ )
+		for ( i = 0; i < 8; i++ )
+		{
+			key_frame( BTN_SOUTH + i, 1 );
+			wait_us( 30000 + rand() % 30000 );
+			key_frame( BTN_SOUTH + i, 0 );
+			wait_us( 20000 + rand() % 20000 );
+		}
+
+	fclose( out );
+}
+
+/* --- keyhack --- */
+
+#define PIANO_KEYS 88
+#define PIANO_FIRST KEY_Q							/* wired to consecutive codes */
+
+static void
+keyhack ( void )
+{
+	struct keydb_entry_s map[ PIANO_KEYS + 1 ];
+	int i, j;
+
+	memset( map, 0, sizeof( map ) );
+
+	map[0].code = KEY_ESC;
+	map[0].control = CKEY_EXIT;
+
+	/* A0 to C8, relative to middle C */
+	for ( i = 0; i < PIANO_KEYS; i++ )
+	{
+		map[ i + 1 ].code = PIANO_FIRST + i;
+		map[ i + 1 ].ev_type = SND_SEQ_EVENT_NOTE;
+		map[ i + 1 ].number = i - 39;
+	}
+
+	if ( keydb_save( "keyhack.keydb", KEYDB_KEYHACK, map, PIANO_KEYS + 1 ) < 0 )
+	{
+		perror( "keyhack.keydb" );
+		exit( 1 );
+	}
+
+	start( "keyhack-glissando.rec", REC_EVDEV );
+
+	for ( j = 0; j < 4; j++ )
+	{
+		/* each key released as the one after next goes down */
+		for ( i = 0; i < PIANO_KEYS + 2; i++ )
+		{
+			int k = j % 2 ? PIANO_KEYS - 1 - i : i;
+			int r = j % 2 ? k + 2 : k - 2;
+
+			if ( i < PIANO_KEYS )
+				key_frame( PIANO_FIRST + k, 1 );
+
+			if ( i >= 2 )
+				key_frame( PIANO_FIRST + r, 0 );
+
+			wait_us( 8000 + rand() % 4000 );
+		}
+
+		wait_us( 300000 );
+	}
+
+	fclose( out );
+}
+
+int
+main ( int argc, char **argv )
+{
+	monterey();
+	joystick();
+	joystick_frames();
+	gamepad();
+	keyhack();
+
+	return 0;
+}
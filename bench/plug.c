@@ -0,0 +1,151 @@
+/* plug.c
+ *
+ * Plug a synthetic device in and out through uinput, for trying the drivers'
+ * hotplugging without the hardware. The device has keys, buttons, relative
+ * and absolute axes and LEDs, so every driver takes it, and types a key (and
+ * presses a button) every 100mS while it's plugged in.
+ *
+ * 	lsmi-keyhack -d 'name=lsmi plug' &
+ * 	bench/plug -u 2 -d 1 -c 5
+ *
+ * usage: plug [-n name] [-u seconds-plugged] [-d seconds-unplugged] [-c cycles]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+static const char *name = "lsmi plug";
+static int up = 2, down = 1, cycles = 3;
+
+static void
+emit ( int fd, int type, int code, int value )
+{
+	struct input_event ev;
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+
+	if ( write( fd, &ev, sizeof( ev ) ) != sizeof( ev ) )
+		perror( "write()" );
+}
+
+/**
+ * Create the device. Returns its uinput fd.
+ */
+static int
+plug ( void )
+{
+	struct uinput_user_dev uidev;
+	int fd, i;
+
+	if ( -1 == ( fd = open( "/dev/uinput", O_WRONLY ) ) &&
+		 -1 == ( fd = open( "/dev/input/uinput", O_WRONLY ) ) )
+	{
+		perror( "Error opening uinput interface" );
+		exit( 1 );
+	}
+
+	memset( &uidev, 0, sizeof( uidev ) );
+	snprintf( uidev.name, sizeof( uidev.name ), "%s", name );
+	uidev.id.bustype = BUS_VIRTUAL;
+	uidev.id.vendor = 0x1209;
+	uidev.id.product = 0x0001;
+	uidev.absmax[ ABS_X ] = uidev.absmax[ ABS_Y ] = 255;
+
+	ioctl( fd, UI_SET_EVBIT, EV_KEY );
+	ioctl( fd, UI_SET_EVBIT, EV_REL );
+	ioctl( fd, UI_SET_EVBIT, EV_ABS );
+	ioctl( fd, UI_SET_EVBIT, EV_MSC );
+	ioctl( fd, UI_SET_EVBIT, EV_LED );
+
+	for ( i = KEY_ESC; i <= KEY_SLASH; i++ )
+		ioctl( fd, UI_SET_KEYBIT, i );
+	for ( i = BTN_LEFT; i <= BTN_MIDDLE; i++ )
+		ioctl( fd, UI_SET_KEYBIT, i );
+	for ( i = BTN_TRIGGER; i <= BTN_BASE4; i++ )
+		ioctl( fd, UI_SET_KEYBIT, i );
+
+	ioctl( fd, UI_SET_RELBIT, REL_X );
+	ioctl( fd, UI_SET_ABSBIT, ABS_X );
+	ioctl( fd, UI_SET_ABSBIT, ABS_Y );
+	ioctl( fd, UI_SET_MSCBIT, MSC_SCAN );
+
+	for ( i = LED_NUML; i <= LED_SCROLLL; i++ )
+		ioctl( fd, UI_SET_LEDBIT, i );
+
+	if ( write( fd, &uidev, sizeof( uidev ) ) != sizeof( uidev ) ||
+		 ioctl( fd, UI_DEV_CREATE, 0 ) < 0 )
+	{
+		perror( "Error creating device" );
+		exit( 1 );
+	}
+
+	return fd;
+}
+
+int
+main ( int argc, char **argv )
+{
+	int c, i, t, fd;
+
+	while ( ( c = getopt( argc, argv, "n:u:d:c:" ) ) != -1 )
+		switch ( c )
+		{
+			case 'n': name = optarg; break;
+			case 'u': up = atoi( optarg ); break;
+			case 'd': down = atoi( optarg ); break;
+			case 'c': cycles = atoi( optarg ); break;
+			default:
+				fprintf( stderr, "usage: plug [-n name] [-u seconds-plugged] [-d seconds-unplugged] [-c cycles]\n" );
+				exit( 1 );
+		}
+
+	for ( i = 0; i < cycles; i++ )
+	{
+		fd = plug();
+
+		printf( "plugged in '%s'\n", name );
+		fflush( stdout );
+
+		for ( t = 0; t < up * 10; t++ )
+		{
+			int key = KEY_Q + t % 10;
+
+			usleep( 50000 );
+			emit( fd, EV_MSC, MSC_SCAN, key );
+			emit( fd, EV_KEY, key, 1 );
+			emit( fd, EV_KEY, BTN_TRIGGER, 1 );
+			emit( fd, EV_SYN, SYN_REPORT, 0 );
+
+			usleep( 50000 );
+			emit( fd, EV_MSC, MSC_SCAN, key );
+			emit( fd, EV_KEY, key, 0 );
+			emit( fd, EV_KEY, BTN_TRIGGER, 0 );
+			emit( fd, EV_SYN, SYN_REPORT, 0 );
+		}
+
+		/* pulled out with the last key still down */
+		emit( fd, EV_KEY, KEY_A, 1 );
+		emit( fd, EV_SYN, SYN_REPORT, 0 );
+
+		ioctl( fd, UI_DEV_DESTROY, 0 );
+		close( fd );
+
+		printf( "unplugged\n" );
+		fflush( stdout );
+
+		if ( i < cycles - 1 )
+			sleep( down );
+	}
+
+	return 0;
+}
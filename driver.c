@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <alsa/asoundlib.h>
+#include <linux/input.h>
+
+#include "seq.h"
+#include "loop.h"
+#include "driver.h"
+#include "input.h"
+#include "replay.h"
+#include "hotplug.h"
+#ifdef USE_IO_URING
+#include "ring.h"
+#endif
+
+/**
+ * Take option /c/ with argument /arg/, if it's one of those every driver
+ * has. Returns 0 if it isn't.
+ */
+int
+driver_option ( struct driver_s *d, int c, char *arg )
+{
+	switch ( c )
+	{
+		case 'p':
+			d->opts.sub_name = arg;
+			break;
+		case 'm':
+			d->opts.rawmidi = arg;
+			break;
+		case 'L':
+			d->opts.latency = atoi( arg );
+			break;
+		case 'b':
+			d->opts.out_buffer = atoi( arg );
+			break;
+		case 'r':
+			d->opts.record_file = arg;
+			break;
+		case 'P':
+			d->opts.replay_file = arg;
+			discard_output();
+			break;
+		case 'F':
+			d->opts.replay_repeat = atoi( arg );
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'z':
+			daemonize = 1;
+			break;
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Open /d/'s output as its options say: a sequencer port or a rawmidi device,
+ * buffered, scheduled and subscribed. Returns the port.
+ */
+int
+open_driver_port ( struct driver_s *d )
+{
+	int port;
+
+	fprintf( stderr, "Registering MIDI port...\n" );
+
+	if ( ( port = d->opts.rawmidi ? open_rawmidi_port( d->opts.rawmidi ) :
+				   open_output_port( port_name ) ) < 0 )
+	{
+		fprintf( stderr, "Error opening MIDI output port!\n" );
+		exit( 1 );
+	}
+
+	if ( d->opts.out_buffer >= 0 )
+		buffer_output( d->opts.out_buffer );
+
+	if ( d->opts.latency >= 0 && schedule_port( port, d->opts.latency ) < 0 )
+		exit( 1 );
+
+	if ( d->opts.sub_name && ! d->opts.rawmidi &&
+		 connect_port( port, d->opts.sub_name ) < 0 )
+		exit( 1 );
+
+	d->port = port;
+
+	return port;
+}
+
+/**
+ * Microseconds on the monotonic clock
+ */
+static long long
+monotonic_us ( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * /d/'s device /node/ is gone, with /err/ (0 for EOF): have it let go of
+ * what it held, silence whatever it left sounding, and start timing how long
+ * it's away
+ */
+void
+driver_lost ( struct driver_s *d, const char *node, int err )
+{
+	fprintf( stderr, "%s: lost %s (%s), waiting for it to come back...\n", d->name, node,
+			 err ? strerror( err ) : "end of file" );
+
+	d->losses++;
+	d->lost_at = monotonic_us();
+
+	if ( d->reset )
+		d->reset();
+
+	if ( d->port >= 0 )
+		all_notes_off( d->port, 0 );
+}
+
+/**
+ * /d/'s device /node/ is back, after driver_lost() if it was lost
+ */
+void
+driver_back ( struct driver_s *d, const char *node )
+{
+	long long down;
+
+	if ( ! d->lost_at )
+	{
+		fprintf( stderr, "%s: attached %s\n", d->name, node );
+		return;
+	}
+
+	down = monotonic_us() - d->lost_at;
+
+	d->down_us += down;
+	d->lost_at = 0;
+
+	fprintf( stderr, "%s: %s is back, after %.3f s\n", d->name, node, down / 1e6 );
+}
+
+/**
+ * Print how often /d/'s device went away and for how long, to /fp/
+ */
+void
+driver_report ( struct driver_s *d, FILE *fp )
+{
+	long long down = d->down_us;
+
+	if ( ! d->losses )
+		return;
+
+	/* still away */
+	if ( d->lost_at )
+		down += monotonic_us() - d->lost_at;
+
+	fprintf( fp, "%s: device lost %d time%s, down %.3f s in all%s\n", d->name, d->losses,
+			 d->losses == 1 ? "" : "s", down / 1e6, d->lost_at ? " (still gone)" : "" );
+}
+
+static void drop_input __P(( struct driver_s *d ));
+static int driver_hotplug __P(( const char *node, int added, void *arg ));
+
+/**
+ * Reading /d/'s device failed with /err/ (0 for EOF). That's the end of a
+ * replay, or the device gone: the driver is parked, with nothing sounding,
+ * until it comes back.
+ */
+void
+driver_input_error ( struct driver_s *d, int err )
+{
+	if ( d->opts.replay_file )
+	{
+		replay_end( d->replay );
+		if ( err )
+			fprintf( stderr, "Error reading replay! (%s)\n", strerror( err ) );
+		stop_driver( d );
+		return;
+	}
+
+	drop_input( d );
+
+	driver_lost( d, d->node, err );
+
+	if ( d->hotplug < 0 &&
+		 -1 == ( d->hotplug = hotplug_watch( driver_hotplug, d ) ) )
+		fprintf( stderr, "Can't watch for %s to come back!\n", d->node );
+}
+
+/**
+ * Pass each complete frame /d/'s input has buffered to its frame(), given
+ * what the last fill returned.
+ */
+static void
+driver_frames ( struct driver_s *d, int n )
+{
+	struct input_event *frame;
+
+	if ( n <= 0 )
+	{
+		if ( n == 0 || ( errno != EINTR && errno != EAGAIN ) )
+			driver_input_error( d, n ? errno : 0 );
+		return;
+	}
+
+	/* the driver may stop itself on any frame */
+	while ( d->running && ( n = input_frame( d->input, &frame ) ) )
+	{
+		d->frame( frame, n );
+
+		flush_events();
+	}
+}
+
+/**
+ * Handle whatever frames a driver's device has ready
+ */
+static void
+driver_input ( int fd, void *arg )
+{
+	struct driver_s *d = arg;
+
+	driver_frames( d, input_fill( d->input ) );
+}
+
+#ifdef USE_IO_URING
+/**
+ * Where the ring should read a driver's device to
+ */
+static void *
+driver_ring_buf ( void *arg, size_t *len )
+{
+	struct driver_s *d = arg;
+
+	return input_space( d->input, len );
+}
+
+/**
+ * Handle the frames a read from the ring brought in
+ */
+static void
+driver_ring_input ( int res, void *arg )
+{
+	struct driver_s *d = arg;
+
+	driver_frames( d, input_filled( d->input, res ) );
+}
+#endif
+
+/**
+ * Start passing /d/ the frames that come in on /in/
+ */
+static void
+watch_input ( struct driver_s *d, struct input_s *in )
+{
+	d->input = in;
+
+	if ( ! d->frame )
+		return;
+
+#ifdef USE_IO_URING
+	if ( ring_watch( in->fd, driver_ring_buf, driver_ring_input, d ) == 0 )
+		return;
+#endif
+
+	watch_fd( in->fd, driver_input, d );
+}
+
+/**
+ * Buffer /d/'s events from /fd/ through /in/, recording them if asked to,
+ * and pass each frame to its frame() as it comes in.
+ */
+void
+attach_input ( struct driver_s *d, struct input_s *in, int fd )
+{
+	input_init( in, fd );
+
+	if ( d->opts.record_file && input_record( in, d->opts.record_file ) < 0 )
+		exit( 1 );
+
+	watch_input( d, in );
+}
+
+/**
+ * Open event device /device/, check that it suits /d/ and take exclusive
+ * access if /flags/ say to. Returns -1, having said why unless /quiet/, if
+ * it can't.
+ */
+static int
+open_device ( struct driver_s *d, const char *device, int flags, int quiet )
+{
+	int fd;
+
+	if ( -1 == ( fd = open( device, flags & INPUT_WRITE ? O_RDWR : O_RDONLY ) ) )
+	{
+		if ( ! quiet )
+			fprintf( stderr, "Error opening event interface! (%s)\n", strerror( errno ) );
+		return -1;
+	}
+
+	if ( d->probe && ! d->probe( fd ) )
+	{
+		if ( ! quiet )
+			fprintf( stderr, "'%s' doesn't seem to be a device for the %s driver! look in /proc/bus/input/devices to find the name of your device's event interface\n", device, d->name );
+		close( fd );
+		errno = ENODEV;
+		return -1;
+	}
+
+	/* exclusive access */
+	if ( flags & INPUT_GRAB && ioctl( fd, EVIOCGRAB, 1 ) )
+	{
+		if ( ! quiet )
+			perror( "EVIOCGRAB" );
+		close( fd );
+		errno = EBUSY;
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Attach /d/'s match for its device, /node/ open on /fd/, keeping what the
+ * driver set up on its input the first time
+ */
+static void
+attach_match ( struct driver_s *d, const char *node, int fd )
+{
+	struct input_s *in = d->match_input;
+	struct record_s *record = in->record;
+	void (*resync) __P(( void )) = in->resync;
+
+	input_init( in, fd );
+
+	in->record = record;
+	in->resync = resync;
+
+	snprintf( d->node, sizeof( d->node ), "%s", node );
+
+	watch_input( d, in );
+}
+
+/**
+ * Stop reading /d/'s device, and let go of it
+ */
+static void
+drop_input ( struct driver_s *d )
+{
+	int fd;
+
+	if ( ! d->input )
+		return;
+
+	fd = d->input->fd;
+
+#ifdef USE_IO_URING
+	ring_unwatch( fd );
+#endif
+	unwatch_fd( fd );
+
+	if ( ! d->opts.replay_file )
+		ioctl( fd, EVIOCGRAB, 0 );
+
+	close( fd );
+
+	d->input = NULL;
+}
+
+/**
+ * An input device came or went: take it if it's the first to match what /d/
+ * is looking for, or let go if it's the one /d/ had. Returns -1 to be asked
+ * again, if the node isn't ready for us yet, or HOTPLUG_UNSURE if the link
+ * /d/ was given isn't there to tell yet.
+ */
+static int
+driver_hotplug ( const char *node, int added, void *arg )
+{
+	struct driver_s *d = arg;
+	int fd;
+
+	if ( ! added )
+	{
+		if ( d->input && ! strcmp( node, d->node ) )
+			driver_input_error( d, ENODEV );
+		return 0;
+	}
+
+	if ( d->input )
+		return 0;
+
+	if ( ! hotplug_match( d->match, node ) )
+		/* its link may be on its way */
+		return hotplug_unresolved( d->match ) ? HOTPLUG_UNSURE : 0;
+
+	if ( -1 == ( fd = open_device( d, node, d->match_flags, 1 ) ) )
+		/* udev may not have given it to us yet */
+		return errno == ENOENT || errno == EACCES || errno == EPERM ? -1 : 0;
+
+	attach_match( d, node, fd );
+
+	driver_back( d, node );
+
+	if ( d->attached )
+		d->attached( fd );
+
+	/* catch up with whatever is held on it already */
+	if ( d->input->resync )
+		d->input->resync();
+
+	flush_events();
+
+	return 0;
+}
+
+/**
+ * Attach /d/ to /in/ with whichever device matches /spec/, now or when one is
+ * plugged in, and again each time one comes back. Returns the fd, or -1 if
+ * there's no such device yet.
+ */
+static int
+match_driver_input ( struct driver_s *d, struct input_s *in, const char *spec, int flags )
+{
+	char node[ sizeof( d->node ) ];
+	int fd;
+
+	/* nothing attached yet, but record from the start */
+	input_init( in, -1 );
+
+	if ( d->opts.record_file && input_record( in, d->opts.record_file ) < 0 )
+		exit( 1 );
+
+	if ( -1 == ( d->hotplug = hotplug_watch( driver_hotplug, d ) ) )
+		fprintf( stderr, "Can't watch for devices coming and going!\n" );
+
+	if ( hotplug_find( spec, node, sizeof( node ) ) == 0 &&
+		 -1 != ( fd = open_device( d, node, flags, 0 ) ) )
+	{
+		fprintf( stderr, "Using %s for '%s'\n", node, spec );
+		attach_match( d, node, fd );
+		return fd;
+	}
+
+	if ( d->hotplug < 0 )
+		exit( 1 );
+
+	fprintf( stderr, "Waiting for a device matching '%s'...\n", spec );
+
+	return -1;
+}
+
+/**
+ * Open event device /device/ for /d/, or its replay file instead, check that
+ * it suits the driver and attach it to /in/. /device/ may instead be a match
+ * spec (see hotplug.c), in which case the device is attached whenever it's
+ * there. Either way, it's opened again if it goes away and comes back.
+ * Returns the fd, or -1 if nothing matches yet.
+ */
+int
+open_driver_input ( struct driver_s *d, struct input_s *in, const char *device, int flags )
+{
+	char real[ PATH_MAX ];
+	int fd;
+
+	if ( d->opts.replay_file )
+	{
+		if ( -1 == ( fd = replay_open( d->opts.replay_file, REC_EVDEV,
+									   d->opts.replay_repeat, &d->replay ) ) )
+			exit( 1 );
+
+		attach_input( d, in, fd );
+
+		return fd;
+	}
+
+	d->match = device;
+	d->match_flags = flags;
+	d->match_input = in;
+
+	if ( hotplug_spec( device ) )
+		return match_driver_input( d, in, device, flags );
+
+	if ( -1 == ( fd = open_device( d, device, flags, 0 ) ) )
+		exit( 1 );
+
+	attach_input( d, in, fd );
+
+	/* as uevents name it, should it go */
+	snprintf( d->node, sizeof( d->node ), "%.*s", (int)sizeof( d->node ) - 1,
+			  realpath( device, real ) ? real : device );
+
+	return fd;
+}
+
+/**
+ * Stop reading /d/'s device, and let go of it for good
+ */
+void
+close_driver_input ( struct driver_s *d )
+{
+	hotplug_unwatch( d->hotplug );
+	d->hotplug = -1;
+
+	drop_input( d );
+}
@@ -0,0 +1,40 @@
+
+/* getopt strings for the options every driver takes */
+#define DRIVER_OPTS "p:m:L:b:r:P:F:vz"
+
+#define DRIVER_LONG_OPTS \
+		{ "port", required_argument, NULL, 'p' }, \
+		{ "rawmidi", required_argument, NULL, 'm' }, \
+		{ "latency", required_argument, NULL, 'L' }, \
+		{ "buffer", required_argument, NULL, 'b' }, \
+		{ "record", required_argument, NULL, 'r' }, \
+		{ "replay", required_argument, NULL, 'P' }, \
+		{ "fast", required_argument, NULL, 'F' }, \
+		{ "verbose", no_argument, NULL, 'v' }, \
+		{ "daemon", no_argument, NULL, 'z' }
+
+#define DRIVER_USAGE \
+		" -v | --verbose                Be verbose (show note events)\n" \
+		" -p | --port client:port       Connect to ALSA Sequencer client on startup\n" \
+		" -m | --rawmidi device         Write MIDI bytes to an ALSA rawmidi device (e.g. hw:1,0)\n" \
+		"                               instead of a sequencer port\n" \
+		" -L | --latency uS             Deliver each event a fixed time after its input\n" \
+		" -b | --buffer bytes           Buffer output, flushing once per input frame (0 = default size)\n" \
+		" -r | --record file            Record input events to file\n" \
+		" -P | --replay file            Read recorded input from file instead of the device\n" \
+		" -F | --fast n                 Replay as fast as possible, n times over\n" \
+		" -z | --daemon                 Fork and don't print anything to stdout\n"
+
+/* open_driver_input() flags */
+#define INPUT_WRITE 1								/* open read/write, for LEDs */
+#define INPUT_GRAB 2								/* take exclusive access */
+
+int driver_option __P(( struct driver_s *d, int c, char *arg ));
+int open_driver_port __P(( struct driver_s *d ));
+int open_driver_input __P(( struct driver_s *d, struct input_s *in, const char *device, int flags ));
+void attach_input __P(( struct driver_s *d, struct input_s *in, int fd ));
+void close_driver_input __P(( struct driver_s *d ));
+void driver_input_error __P(( struct driver_s *d, int err ));
+void driver_lost __P(( struct driver_s *d, const char *node, int err ));
+void driver_back __P(( struct driver_s *d, const char *node ));
+void driver_report __P(( struct driver_s *d, FILE *fp ));
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/cdefs.h>
+
+#include <linux/netlink.h>
+
+#include "loop.h"
+#include "hotplug.h"
+
+/* Event devices are matched by what sysfs says about them, against a spec
+ * given in place of a device node:
+ *
+ * 	name=pattern		the device's name (shell wildcards allowed)
+ * 	id=vendor:product	its vendor and product IDs, in hex
+ * 	phys=pattern		its physical path (e.g. usb-0000:00:1d.0-1/input0)
+ *
+ * Devices coming and going are seen through the kernel's uevents on netlink,
+ * so a device can be plugged in after startup, or unplugged and back, with
+ * nothing else disturbed. */
+
+#define MAX_HOTPLUG_WATCHES 8
+#define MAX_PENDING 8
+#define RETRY_MS 20										/* opening a new node */
+#define RETRIES 100
+
+/* a watcher of devices coming and going */
+struct hotplug_watch_s {
+	hotplug_f f;
+	void *arg;
+};
+
+/* a node added that a watcher couldn't take yet */
+struct pending_s {
+	char node[ 32 ];
+	int w;
+	int left;										/* retries */
+	int quiet;										/* when they run out */
+};
+
+static struct hotplug_watch_s hotplug_watches[ MAX_HOTPLUG_WATCHES ];
+static struct pending_s pending[ MAX_PENDING ];
+static int nlfd = -1;									/* uevents */
+static int rtfd = -1;									/* retry timer */
+
+/**
+ * Whether /device/ is a match spec rather than a device node
+ */
+int
+hotplug_spec ( const char *device )
+{
+	return ! strncmp( device, "name=", 5 ) ||
+		   ! strncmp( device, "id=", 3 ) ||
+		   ! strncmp( device, "phys=", 5 );
+}
+
+/**
+ * Read attribute /attr/ of the input device behind event device /event/
+ * (e.g. "event3") into /buf/, without the newline. Returns -1 if it can't.
+ */
+static int
+sysfs_attr ( const char *event, const char *attr, char *buf, int size )
+{
+	char path[ 128 ];
+	FILE *fp;
+	char *nl;
+
+	snprintf( path, sizeof( path ), "/sys/class/input/%.32s/device/%s", event, attr );
+
+	if ( ! ( fp = fopen( path, "r" ) ) )
+		return -1;
+
+	if ( ! fgets( buf, size, fp ) )
+		*buf = '\0';
+
+	fclose( fp );
+
+	if ( ( nl = strchr( buf, '\n' ) ) )
+		*nl = '\0';
+
+	return 0;
+}
+
+/**
+ * Whether input device /node/ matches /spec/, or is the node (or a link to
+ * it) if /spec/ isn't a match spec
+ */
+int
+hotplug_match ( const char *spec, const char *node )
+{
+	const char *event = strrchr( node, '/' );
+	char buf[ PATH_MAX ];
+	unsigned int vendor, product;
+
+	if ( ! hotplug_spec( spec ) )
+		return ! strcmp( spec, node ) ||
+			   ( realpath( spec, buf ) && ! strcmp( buf, node ) );
+
+	event = event ? event + 1 : node;
+
+	if ( ! strncmp( spec, "name=", 5 ) )
+		return sysfs_attr( event, "name", buf, sizeof( buf ) ) == 0 &&
+			   ! fnmatch( spec + 5, buf, 0 );
+
+	if ( ! strncmp( spec, "phys=", 5 ) )
+		return sysfs_attr( event, "phys", buf, sizeof( buf ) ) == 0 &&
+			   ! fnmatch( spec + 5, buf, 0 );
+
+	if ( ! strncmp( spec, "id=", 3 ) )
+	{
+		if ( sscanf( spec + 3, "%x:%x", &vendor, &product ) != 2 )
+			return 0;
+
+		if ( sysfs_attr( event, "id/vendor", buf, sizeof( buf ) ) < 0 ||
+			 strtoul( buf, NULL, 16 ) != vendor )
+			return 0;
+
+		return sysfs_attr( event, "id/product", buf, sizeof( buf ) ) == 0 &&
+			   strtoul( buf, NULL, 16 ) == product;
+	}
+
+	return 0;
+}
+
+/**
+ * Whether /spec/ is a node (or a link to one, as in /dev/input/by-id) that
+ * isn't there to be matched yet. udev makes links after the kernel's uevent,
+ * so a device added may turn out to be the one once its link appears.
+ */
+int
+hotplug_unresolved ( const char *spec )
+{
+	struct stat st;
+
+	return ! hotplug_spec( spec ) && lstat( spec, &st ) < 0 && errno == ENOENT;
+}
+
+/**
+ * Put the node of the lowest numbered event device present matching /spec/
+ * in /node/. Returns -1 if there's none.
+ */
+int
+hotplug_find ( const char *spec, char *node, int size )
+{
+	struct dirent *de;
+	DIR *dir;
+	int n, found = -1;
+
+	if ( ! ( dir = opendir( "/sys/class/input" ) ) )
+		return -1;
+
+	while ( ( de = readdir( dir ) ) )
+		if ( sscanf( de->d_name, "event%d", &n ) == 1 &&
+			 ( found < 0 || n < found ) &&
+			 hotplug_match( spec, de->d_name ) )
+			found = n;
+
+	closedir( dir );
+
+	if ( found < 0 )
+		return -1;
+
+	snprintf( node, size, "/dev/input/event%d", found );
+
+	return 0;
+}
+
+/**
+ * Run the retry timer while anything is pending
+ */
+static void
+arm_retries ( void )
+{
+	struct itimerspec its;
+	int i;
+
+	memset( &its, 0, sizeof( its ) );
+
+	for ( i = 0; i < MAX_PENDING; i++ )
+		if ( pending[i].left )
+		{
+			its.it_value.tv_nsec = its.it_interval.tv_nsec = RETRY_MS * 1000000;
+			break;
+		}
+
+	timerfd_settime( rtfd, 0, &its, NULL );
+}
+
+/**
+ * Tell every watcher that /node/ came or went. Those that couldn't take a new
+ * node are asked again shortly.
+ */
+static void
+notify ( const char *node, int added )
+{
+	int i, j;
+
+	for ( j = 0; j < MAX_PENDING; j++ )
+		if ( pending[j].left && ! strcmp( pending[j].node, node ) )
+			pending[j].left = 0;
+
+	for ( i = 0; i < MAX_HOTPLUG_WATCHES; i++ )
+	{
+		int r;
+
+		if ( ! hotplug_watches[i].f ||
+			 ( r = hotplug_watches[i].f( node, added, hotplug_watches[i].arg ) ) == 0 ||
+			 ! added )
+			continue;
+
+		for ( j = 0; j < MAX_PENDING; j++ )
+			if ( ! pending[j].left )
+				break;
+
+		if ( j == MAX_PENDING )
+			continue;
+
+		snprintf( pending[j].node, sizeof( pending[j].node ), "%s", node );
+		pending[j].w = i;
+		pending[j].left = RETRIES;
+		pending[j].quiet = r == HOTPLUG_UNSURE;
+	}
+
+	arm_retries();
+}
+
+/**
+ * Ask again about the nodes that weren't ready
+ */
+static void
+retry_pending ( int fd, void *arg )
+{
+	unsigned long long expirations;
+	struct pending_s *p;
+	int i;
+
+	if ( read( fd, &expirations, sizeof( expirations ) ) != sizeof( expirations ) )
+		return;
+
+	for ( i = 0; i < MAX_PENDING; i++ )
+	{
+		int r;
+
+		p = &pending[i];
+
+		if ( ! p->left )
+			continue;
+
+		if ( ! hotplug_watches[ p->w ].f ||
+			 ( r = hotplug_watches[ p->w ].f( p->node, 1, hotplug_watches[ p->w ].arg ) ) == 0 )
+			p->left = 0;
+		else
+		{
+			/* sure enough now, if only that it isn't ready */
+			if ( r != HOTPLUG_UNSURE )
+				p->quiet = 0;
+
+			if ( ! --p->left && ! p->quiet )
+				fprintf( stderr, "Giving up on %s\n", p->node );
+		}
+	}
+
+	arm_retries();
+}
+
+/**
+ * Handle the uevents the kernel has sent, passing on input devices added and
+ * removed
+ */
+static void
+uevents ( int fd, void *arg )
+{
+	char buf[ 4096 ];
+	struct sockaddr_nl sa;
+	socklen_t salen;
+	ssize_t len;
+
+	for ( ;; )
+	{
+		const char *action = NULL, *subsystem = NULL, *devname = NULL;
+		char node[ 32 ];
+		char *p;
+
+		salen = sizeof( sa );
+
+		if ( ( len = recvfrom( fd, buf, sizeof( buf ) - 1, 0,
+							   (struct sockaddr *)&sa, &salen ) ) <= 0 )
+			return;
+
+		/* only believe the kernel */
+		if ( sa.nl_pid != 0 )
+			continue;
+
+		buf[ len ] = '\0';
+
+		/* "action@devpath", then KEY=value strings */
+		for ( p = buf + strlen( buf ) + 1; p < buf + len; p += strlen( p ) + 1 )
+		{
+			if ( ! strncmp( p, "ACTION=", 7 ) )
+				action = p + 7;
+			else if ( ! strncmp( p, "SUBSYSTEM=", 10 ) )
+				subsystem = p + 10;
+			else if ( ! strncmp( p, "DEVNAME=", 8 ) )
+				devname = p + 8;
+		}
+
+		if ( ! action || ! subsystem || ! devname ||
+			 strcmp( subsystem, "input" ) || strncmp( devname, "input/", 6 ) )
+			continue;
+
+		snprintf( node, sizeof( node ), "/dev/%s", devname );
+
+		if ( ! strcmp( action, "add" ) )
+			notify( node, 1 );
+		else if ( ! strcmp( action, "remove" ) )
+			notify( node, 0 );
+	}
+}
+
+/**
+ * Start listening to the kernel's uevents. Returns -1 on error.
+ */
+static int
+hotplug_open ( void )
+{
+	struct sockaddr_nl sa;
+
+	if ( -1 == ( nlfd = socket( AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								NETLINK_KOBJECT_UEVENT ) ) )
+	{
+		perror( "uevent socket" );
+		return -1;
+	}
+
+	memset( &sa, 0, sizeof( sa ) );
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = 1;								/* the kernel's, not udev's */
+
+	if ( bind( nlfd, (struct sockaddr *)&sa, sizeof( sa ) ) < 0 ||
+		 -1 == ( rtfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ) )
+	{
+		perror( "uevent socket" );
+		close( nlfd );
+		nlfd = -1;
+		return -1;
+	}
+
+	watch_fd( nlfd, uevents, NULL );
+	watch_fd( rtfd, retry_pending, NULL );
+
+	return 0;
+}
+
+/**
+ * Call /f/ with /arg/ whenever an event device is added or removed. Returns
+ * a handle for hotplug_unwatch(), or -1 on error.
+ */
+int
+hotplug_watch ( hotplug_f f, void *arg )
+{
+	int i;
+
+	if ( nlfd < 0 && hotplug_open() < 0 )
+		return -1;
+
+	for ( i = 0; i < MAX_HOTPLUG_WATCHES; i++ )
+		if ( ! hotplug_watches[i].f )
+			break;
+
+	if ( i == MAX_HOTPLUG_WATCHES )
+		return -1;
+
+	hotplug_watches[i].f = f;
+	hotplug_watches[i].arg = arg;
+
+	return i;
+}
+
+/**
+ * Stop calling the watcher with handle /w/
+ */
+void
+hotplug_unwatch ( int w )
+{
+	int i;
+
+	if ( w < 0 )
+		return;
+
+	hotplug_watches[w].f = NULL;
+
+	for ( i = 0; i < MAX_PENDING; i++ )
+		if ( pending[i].w == w )
+			pending[i].left = 0;
+}
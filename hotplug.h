@@ -0,0 +1,14 @@
+
+/* an input device /node/ came (added) or went; return -1 to be asked again
+ * shortly, as when its node isn't ready to open yet, or HOTPLUG_UNSURE to be
+ * asked again but let go quietly, as when what it is isn't known yet */
+#define HOTPLUG_UNSURE -2
+
+typedef int (*hotplug_f) __P(( const char *node, int added, void *arg ));
+
+int hotplug_spec __P(( const char *device ));
+int hotplug_match __P(( const char *spec, const char *node ));
+int hotplug_unresolved __P(( const char *spec ));
+int hotplug_find __P(( const char *spec, char *node, int size ));
+int hotplug_watch __P(( hotplug_f f, void *arg ));
+void hotplug_unwatch __P(( int w ));
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/cdefs.h>
+
+#include <linux/input.h>
+
+#include "input.h"
+#include "lat.h"
+#include "replay.h"
+#include "sig.h"
+
+/* SYN_DROPPED seen, on all inputs */
+unsigned long input_drops = 0;
+
+/**
+ * Prepare /in/ to buffer events from the device open on /fd/. Asks for
+ * monotonic timestamps, so latency can be measured against them. With no
+ * device yet (/fd/ -1), the clock is the one a device attached later will
+ * be asked for, so timers set up before then run on it.
+ */
+void
+input_init ( struct input_s *in, int fd )
+{
+	memset( in, 0, sizeof( *in ) );
+
+	in->fd = fd;
+	in->clock = CLOCK_MONOTONIC;
+
+	if ( fd >= 0 && ioctl( fd, EVIOCSCLOCKID, &in->clock ) < 0 )
+		in->clock = CLOCK_REALTIME;
+}
+
+/**
+ * Have the kernel deliver only the codes of event /type/ set in bitmap
+ * /codes/ (of /size/ bytes); type 0 masks event types instead. Unmasked types
+ * still get through, so EV_SYN must be kept in the type mask. Returns -1 if
+ * the kernel can't mask events (before 4.4) or /in/ isn't a device, in which
+ * case the caller is left to ignore the events itself.
+ */
+int
+input_mask ( struct input_s *in, int type, const unsigned char *codes, int size )
+{
+#ifdef EVIOCSMASK
+	struct input_mask mask;
+
+	mask.type = type;
+	mask.codes_size = size;
+	mask.codes_ptr = (unsigned long)codes;
+
+	return ioctl( in->fd, EVIOCSMASK, &mask ) < 0 ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Record all events subsequently read by /in/ to /file/. Returns -1 on error.
+ */
+int
+input_record ( struct input_s *in, const char *file )
+{
+	return ( in->record = record_open( file, REC_EVDEV ) ) ? 0 : -1;
+}
+
+/**
+ * Make room for the next read into /in/: any partial frame (or event) left
+ * over from the last one is moved to the front of the buffer. Returns where
+ * to read to, with the number of bytes that fit in /len/.
+ */
+void *
+input_space ( struct input_s *in, size_t *len )
+{
+	if ( in->pos )
+	{
+		memmove( in->buf, in->buf + in->pos,
+				 ( in->len - in->pos ) * sizeof( struct input_event ) + in->part );
+		in->len -= in->pos;
+		in->pos = 0;
+	}
+
+	*len = ( INPUT_BATCH - in->len ) * sizeof( struct input_event ) - in->part;
+
+	return (char *)( in->buf + in->len ) + in->part;
+}
+
+/**
+ * Take the result /r/ of a read to input_space(): bytes read, or -1 (with
+ * errno set) or -errno on error. Returns the number of events, 0 on EOF, or
+ * -1 on error. A read too short to complete an event is kept for the next
+ * and fails with EAGAIN.
+ */
+int
+input_filled ( struct input_s *in, ssize_t r )
+{
+	int n;
+
+	if ( r < -1 )
+		errno = -r;
+
+	if ( r < 0 )
+		return -1;
+
+	if ( r == 0 )
+		return 0;
+
+	r += in->part;
+
+	n = r / sizeof( struct input_event );
+	in->part = r % sizeof( struct input_event );
+
+	if ( ! n )
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if ( in->record )
+		record_evdev( in->record, in->buf + in->len, n );
+
+	events_read += n;
+	in->len += n;
+
+	return n;
+}
+
+/**
+ * Read as many events as the device has ready (up to the free space in the
+ * buffer) with a single read(). Returns the number of events read, 0 on EOF,
+ * or -1 on error.
+ */
+int
+input_fill ( struct input_s *in )
+{
+	void *buf;
+	size_t len;
+	ssize_t r;
+
+	buf = input_space( in, &len );
+
+	do
+		r = read( in->fd, buf, len );
+	while ( r < 0 && errno == EINTR );
+
+	return input_filled( in, r );
+}
+
+/**
+ * Point /frame/ at the next complete frame in the buffer (all events up to
+ * and including the terminating SYN_REPORT). Returns the number of events in
+ * the frame, or 0 if no complete frame is buffered. A frame too large for the
+ * buffer is handed out in pieces.
+ *
+ * When the kernel reports having dropped events (SYN_DROPPED), the frame it
+ * interrupted and the rest of the one it's in are thrown away, and then
+ * in->resync is called to bring the driver up to date with the device before
+ * any more frames are handed out.
+ */
+int
+input_frame ( struct input_s *in, struct input_event **frame )
+{
+	int i;
+
+	for ( i = in->pos; i < in->len; i++ )
+	{
+		if ( in->buf[i].type != EV_SYN )
+			continue;
+
+		if ( in->buf[i].code == SYN_DROPPED )
+		{
+			input_drops++;
+
+			in->discarding = 1;
+			in->pos = i + 1;
+		}
+		else
+		if ( in->buf[i].code == SYN_REPORT )
+		{
+			if ( ! in->discarding )
+				break;
+
+			in->discarding = 0;
+			in->pos = i + 1;
+
+			if ( in->resync )
+				in->resync();
+		}
+	}
+
+	if ( i == in->len )
+	{
+		if ( in->discarding )
+		{
+			in->pos = in->len;
+			return 0;
+		}
+
+		if ( in->pos > 0 || in->len < INPUT_BATCH )
+			return 0;
+
+		/* buffer is full and still no SYN_REPORT */
+		i = in->len - 1;
+	}
+
+	*frame = in->buf + in->pos;
+
+	lat_stamp( &in->buf[i].time, in->clock );
+
+	i = i + 1 - in->pos;
+	in->pos += i;
+
+	return i;
+}
+
+/**
+ * Block until a complete frame is available. Returns the number of events in
+ * the frame, or what input_fill() returned on EOF or error.
+ */
+int
+input_read_frame ( struct input_s *in, struct input_event **frame )
+{
+	int n;
+
+	while ( ! ( n = input_frame( in, frame ) ) )
+	{
+		/* outside the main loop, so take signals here */
+		if ( wait_readable( in->fd ) < 0 )
+			return -1;
+
+		if ( ( n = input_fill( in ) ) == 0 || ( n < 0 && errno != EAGAIN ) )
+			return n;
+	}
+
+	return n;
+}
+
+/**
+ * Read the state of the device's keys into bitmap /keys/ (of /size/ bytes).
+ * Returns -1, with all keys up, if it can't be read (as when replaying).
+ */
+int
+input_keys ( struct input_s *in, unsigned char *keys, int size )
+{
+	memset( keys, 0, size );
+
+	if ( ioctl( in->fd, EVIOCGKEY( size ), keys ) < 0 )
+	{
+		memset( keys, 0, size );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Print how often the kernel dropped input events, if it ever did
+ */
+void
+input_report ( FILE *fp )
+{
+	if ( input_drops )
+		fprintf( fp, "Input overruns: %lu (events dropped by the kernel, state resynced)\n",
+				 input_drops );
+}
@@ -0,0 +1,28 @@
+
+#define INPUT_BATCH 64								/* events per read() */
+
+/* buffered event device */
+struct input_s {
+	int fd;
+	int clock;										/* of event timestamps */
+	int len;										/* events in buf */
+	int pos;										/* first unconsumed event */
+	int part;										/* bytes of an event read short */
+	struct record_s *record;					/* copy of all events read, or NULL */
+	int discarding;									/* events up to the next SYN_REPORT */
+	void (*resync) __P(( void ));					/* after lost events, or NULL */
+	struct input_event buf[ INPUT_BATCH ];
+};
+
+extern unsigned long input_drops;
+
+void input_init __P(( struct input_s *in, int fd ));
+int input_mask __P(( struct input_s *in, int type, const unsigned char *codes, int size ));
+int input_record __P(( struct input_s *in, const char *file ));
+void *input_space __P(( struct input_s *in, size_t *len ));
+int input_filled __P(( struct input_s *in, ssize_t r ));
+int input_fill __P(( struct input_s *in ));
+int input_frame __P(( struct input_s *in, struct input_event **frame ));
+int input_read_frame __P(( struct input_s *in, struct input_event **frame ));
+int input_keys __P(( struct input_s *in, unsigned char *keys, int size ));
+void input_report __P(( FILE *fp ));
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/cdefs.h>
+
+#include "keydb.h"
+
+/* A key database is a header followed by one entry per mapped key, in key
+ * code order. Everything is in the byte order of the machine that wrote it,
+ * which the header records, as it does the entry size, so a database written
+ * by a build with a different layout is refused rather than misread. */
+
+#define KEYDB_MAGIC "LSKD"
+#define KEYDB_VERSION 1
+#define KEYDB_ORDER 0x0102
+
+struct keydb_header_s {
+	char magic[4];
+	uint16_t order;									/* KEYDB_ORDER, as written */
+	uint8_t version;
+	uint8_t kind;
+	uint16_t entry_size;
+	uint16_t reserved;
+	uint32_t count;
+	uint32_t checksum;								/* of the entries */
+};
+
+/**
+ * Return FNV-1a hash of /size/ bytes at /p/
+ */
+static uint32_t
+checksum ( const void *p, size_t size )
+{
+	const unsigned char *b = p;
+	uint32_t h = 2166136261U;
+
+	while ( size-- )
+		h = ( h ^ *b++ ) * 16777619U;
+
+	return h;
+}
+
+/**
+ * Map key database /file/ of /kind/ read-only into /db/. Returns 0 on
+ * success, -1 if there's no such file, or -2 if it isn't a valid database of
+ * this kind (it may be one in the old raw format).
+ */
+int
+keydb_load ( struct keydb_s *db, const char *file, int kind )
+{
+	const struct keydb_header_s *h;
+	struct stat st;
+	int fd;
+
+	memset( db, 0, sizeof( *db ) );
+
+	if ( -1 == ( fd = open( file, O_RDONLY ) ) )
+		return -1;
+
+	if ( fstat( fd, &st ) < 0 ||
+		 st.st_size < sizeof( *h ) ||
+		 MAP_FAILED == ( db->base = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) ) )
+	{
+		close( fd );
+		db->base = NULL;
+		return -2;
+	}
+
+	close( fd );
+
+	db->size = st.st_size;
+
+	h = db->base;
+
+	if ( memcmp( h->magic, KEYDB_MAGIC, 4 ) )
+		goto invalid;
+
+	if ( h->order != KEYDB_ORDER ||
+		 h->version != KEYDB_VERSION ||
+		 h->entry_size != sizeof( struct keydb_entry_s ) )
+	{
+		fprintf( stderr, "Key database '%s' was written by an incompatible version or machine!\n", file );
+		goto invalid;
+	}
+
+	if ( h->kind != kind )
+	{
+		fprintf( stderr, "Key database '%s' belongs to another driver!\n", file );
+		goto invalid;
+	}
+
+	if ( db->size != sizeof( *h ) + h->count * sizeof( struct keydb_entry_s ) ||
+		 checksum( h + 1, h->count * sizeof( struct keydb_entry_s ) ) != h->checksum )
+	{
+		fprintf( stderr, "Key database '%s' is corrupt!\n", file );
+		goto invalid;
+	}
+
+	db->entries = (const struct keydb_entry_s *)( h + 1 );
+	db->count = h->count;
+
+	return 0;
+
+invalid:
+
+	keydb_unload( db );
+
+	return -2;
+}
+
+/**
+ * Release database mapped by keydb_load()
+ */
+void
+keydb_unload ( struct keydb_s *db )
+{
+	if ( db->base )
+		munmap( db->base, db->size );
+
+	memset( db, 0, sizeof( *db ) );
+}
+
+/**
+ * Replace key database /file/ of /kind/ with /count/ /entries/. The new
+ * database is written beside the old and renamed over it, so either one or
+ * the other is always there intact. Returns -1 on error.
+ */
+int
+keydb_save ( const char *file, int kind, const struct keydb_entry_s *entries, int count )
+{
+	struct keydb_header_s h;
+	size_t size = count * sizeof( *entries );
+	char *tmp;
+	int fd, ok;
+
+	memset( &h, 0, sizeof( h ) );
+
+	memcpy( h.magic, KEYDB_MAGIC, 4 );
+	h.order = KEYDB_ORDER;
+	h.version = KEYDB_VERSION;
+	h.kind = kind;
+	h.entry_size = sizeof( *entries );
+	h.count = count;
+	h.checksum = checksum( entries, size );
+
+	tmp = malloc( strlen( file ) + 8 );
+	sprintf( tmp, "%s.XXXXXX", file );
+
+	if ( -1 == ( fd = mkstemp( tmp ) ) )
+	{
+		free( tmp );
+		return -1;
+	}
+
+	fchmod( fd, 0666 & ~umask( umask( 0 ) ) );
+
+	ok = write( fd, &h, sizeof( h ) ) == sizeof( h ) &&
+		 write( fd, entries, size ) == size &&
+		 fsync( fd ) == 0;
+
+	if ( close( fd ) < 0 || ! ok || rename( tmp, file ) < 0 )
+	{
+		unlink( tmp );
+		free( tmp );
+		return -1;
+	}
+
+	free( tmp );
+
+	return 0;
+}
+
+/**
+ * Read a database in the old format, a raw dump of a driver's key map, into
+ * /buf/. Returns -1 unless /file/ is exactly /size/ bytes.
+ */
+int
+keydb_load_raw ( const char *file, void *buf, size_t size )
+{
+	struct stat st;
+	int fd, r;
+
+	if ( -1 == ( fd = open( file, O_RDONLY ) ) )
+		return -1;
+
+	r = fstat( fd, &st ) == 0 && st.st_size == size &&
+		read( fd, buf, size ) == size ? 0 : -1;
+
+	close( fd );
+
+	return r;
+}
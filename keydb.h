@@ -0,0 +1,28 @@
+/* which driver's key database */
+#define KEYDB_KEYHACK 1
+#define KEYDB_GAMEPAD 2
+
+#define KEYDB_ACTIVE 0x01							/* entry flag: toggle is on */
+
+/* one mapped key */
+struct keydb_entry_s {
+	uint16_t code;									/* evdev key code */
+	uint8_t control;								/* control key, or 0 */
+	uint8_t ev_type;								/* sequencer event type, or 0 */
+	int16_t number;									/* note or controller # */
+	uint8_t flags;
+	uint8_t reserved;
+};
+
+/* a loaded (mapped) key database */
+struct keydb_s {
+	void *base;
+	size_t size;
+	const struct keydb_entry_s *entries;			/* sorted by code */
+	int count;
+};
+
+int keydb_load __P(( struct keydb_s *db, const char *file, int kind ));
+void keydb_unload __P(( struct keydb_s *db ));
+int keydb_save __P(( const char *file, int kind, const struct keydb_entry_s *entries, int count ));
+int keydb_load_raw __P(( const char *file, void *buf, size_t size ));
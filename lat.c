@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/cdefs.h>
+
+#include "lat.h"
+
+/* Latency from the kernel's timestamp on an input event to the moment we
+ * dispatch the MIDI (or uinput) event it produced, in power of two
+ * microsecond buckets. Counters are only ever added to atomically, so
+ * lat_dump() may be called from anywhere, at any time. */
+
+static unsigned long histogram[ LAT_CLASSES ][ LAT_BUCKETS ];
+
+static const char *class_names[ LAT_CLASSES ] = { "note", "cc", "program", "uinput" };
+
+/* timestamp of the input currently being handled */
+static struct timespec stamp;
+static clockid_t stamp_clock = CLOCK_MONOTONIC;
+
+/**
+ * Note that the input being handled was stamped /tv/ by the kernel, from
+ * /clock/.
+ */
+void
+lat_stamp ( const struct timeval *tv, int clock )
+{
+	stamp.tv_sec = tv->tv_sec;
+	stamp.tv_nsec = tv->tv_usec * 1000;
+	stamp_clock = clock;
+}
+
+/**
+ * Note that no input is being handled, as when a timer goes off, so nothing
+ * sent is aged from whatever input came last, perhaps to another driver
+ */
+void
+lat_clear ( void )
+{
+	stamp.tv_sec = 0;
+}
+
+/**
+ * Return the microseconds since the input being handled was stamped, or -1
+ * if there is none
+ */
+long long
+lat_age ( void )
+{
+	struct timespec now;
+
+	if ( ! stamp.tv_sec )
+		return -1;
+
+	clock_gettime( stamp_clock, &now );
+
+	return ( now.tv_sec - stamp.tv_sec ) * 1000000LL +
+		   ( now.tv_nsec - stamp.tv_nsec ) / 1000;
+}
+
+/**
+ * Count an event of class /class/ dispatched now
+ */
+void
+lat_record ( int class )
+{
+	long long us;
+	int b;
+
+	if ( ( us = lat_age() ) < 0 )
+		return;
+
+	/* bucket b holds [ 2^(b-1), 2^b ) */
+	for ( b = 0; b < LAT_BUCKETS - 1 && us >= ( 1LL << b ); b++ )
+		;
+
+	__atomic_fetch_add( &histogram[ class ][ b ], 1, __ATOMIC_RELAXED );
+}
+
+/**
+ * Print the histograms to /fp/
+ */
+void
+lat_dump ( FILE *fp )
+{
+	unsigned long h[ LAT_CLASSES ][ LAT_BUCKETS ];
+	unsigned long total[ LAT_CLASSES ] = { 0 };
+	int c, b, lo = LAT_BUCKETS, hi = -1;
+
+	for ( c = 0; c < LAT_CLASSES; c++ )
+		for ( b = 0; b < LAT_BUCKETS; b++ )
+		{
+			h[c][b] = __atomic_load_n( &histogram[c][b], __ATOMIC_RELAXED );
+			total[c] += h[c][b];
+
+			if ( h[c][b] )
+			{
+				lo = b < lo ? b : lo;
+				hi = b > hi ? b : hi;
+			}
+		}
+
+	fprintf( fp, "Latency (input timestamp to dispatch):\n" );
+
+	if ( hi < 0 )
+	{
+		fprintf( fp, "  no events\n" );
+		return;
+	}
+
+	fprintf( fp, "  %-12s", "uS" );
+	for ( c = 0; c < LAT_CLASSES; c++ )
+		fprintf( fp, "%10s", class_names[c] );
+	fprintf( fp, "\n" );
+
+	for ( b = lo; b <= hi; b++ )
+	{
+		if ( b == LAT_BUCKETS - 1 )
+			fprintf( fp, "  >= %-9lu", 1UL << ( b - 1 ) );
+		else
+			fprintf( fp, "  < %-10lu", 1UL << b );
+
+		for ( c = 0; c < LAT_CLASSES; c++ )
+			fprintf( fp, "%10lu", h[c][b] );
+		fprintf( fp, "\n" );
+	}
+
+	fprintf( fp, "  %-12s", "total" );
+	for ( c = 0; c < LAT_CLASSES; c++ )
+		fprintf( fp, "%10lu", total[c] );
+	fprintf( fp, "\n" );
+
+	/* the bucket bound under which 99% of events fell */
+	fprintf( fp, "  %-12s", "99% < uS" );
+	for ( c = 0; c < LAT_CLASSES; c++ )
+	{
+		unsigned long n = 0;
+
+		for ( b = 0; b < LAT_BUCKETS && total[c]; b++ )
+			if ( ( n += h[c][b] ) * 100 >= total[c] * 99 )
+				break;
+
+		if ( ! total[c] )
+			fprintf( fp, "%10s", "-" );
+		else
+		if ( b >= LAT_BUCKETS - 1 )
+			fprintf( fp, "%10s", "inf" );
+		else
+			fprintf( fp, "%10lu", 1UL << b );
+	}
+	fprintf( fp, "\n" );
+}
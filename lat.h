@@ -0,0 +1,11 @@
+
+/* classes of output event we keep latency histograms for */
+enum lat_class { LAT_NOTE, LAT_CC, LAT_PGM, LAT_UINPUT, LAT_CLASSES };
+
+#define LAT_BUCKETS 24								/* <1uS, <2uS, <4uS ... */
+
+void lat_stamp __P(( const struct timeval *tv, int clock ));
+void lat_clear __P(( void ));
+long long lat_age __P(( void ));
+void lat_record __P(( int class ));
+void lat_dump __P(( FILE *fp ));
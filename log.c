@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/cdefs.h>
+
+#include "log.h"
+
+/* Diagnostic output is never formatted on the thread handling input: each
+ * message is queued as a binary record (a static format string and its
+ * arguments) in a single producer, single consumer ring and printed later by
+ * a low priority thread. If the ring is full the message is dropped and
+ * counted; the producer never waits. */
+
+struct log_s {
+	FILE *fp;
+	const char *fmt;								/* static */
+	const char *s;									/* static, or NULL */
+	int a;
+	int b;
+};
+
+static struct log_s ring[ LOG_RECORDS ];
+static unsigned int head = 0;						/* next to write, producer owned */
+static unsigned int tail = 0;						/* next to print, consumer owned */
+
+static pthread_t thread;
+static int started = 0;
+static int stopping = 0;
+static int wakefd = -1;								/* cuts an idle wait short */
+
+unsigned long log_dropped = 0;
+
+/**
+ * Queue a record, or drop it if the ring is full
+ */
+static void
+push ( FILE *fp, const char *fmt, const char *s, int a, int b )
+{
+	unsigned int h = head;
+	struct log_s *r;
+
+	if ( h - __atomic_load_n( &tail, __ATOMIC_ACQUIRE ) == LOG_RECORDS )
+	{
+		log_dropped++;
+		return;
+	}
+
+	r = &ring[ h & ( LOG_RECORDS - 1 ) ];
+
+	r->fp = fp;
+	r->fmt = fmt;
+	r->s = s;
+	r->a = a;
+	r->b = b;
+
+	__atomic_store_n( &head, h + 1, __ATOMIC_RELEASE );
+}
+
+/**
+ * Queue printf( /fmt/, /a/, /b/ ) to /fp/. /fmt/ must be static and take at
+ * most two ints.
+ */
+void
+log_msg ( FILE *fp, const char *fmt, int a, int b )
+{
+	push( fp, fmt, NULL, a, b );
+}
+
+/**
+ * Queue printf( /fmt/, /s/ ) to /fp/. Both strings must be static.
+ */
+void
+log_str ( FILE *fp, const char *fmt, const char *s )
+{
+	push( fp, fmt, s, 0, 0 );
+}
+
+/**
+ * Print everything queued, returning the number of records printed
+ */
+static int
+drain ( void )
+{
+	unsigned int h = __atomic_load_n( &head, __ATOMIC_ACQUIRE );
+	unsigned int t = tail;
+	int n = 0;
+
+	for ( ; t != h; t++, n++ )
+	{
+		struct log_s *r = &ring[ t & ( LOG_RECORDS - 1 ) ];
+
+		if ( r->s )
+			fprintf( r->fp, r->fmt, r->s );
+		else
+			fprintf( r->fp, r->fmt, r->a, r->b );
+
+		__atomic_store_n( &tail, t + 1, __ATOMIC_RELEASE );
+	}
+
+	if ( n )
+	{
+		fflush( stdout );
+		fflush( stderr );
+	}
+
+	return n;
+}
+
+/**
+ * Print records as they come, polling every 100mS while idle. Producers never
+ * wake the thread, only log_stop() does.
+ */
+static void *
+log_thread ( void *arg )
+{
+	struct pollfd pfd = { wakefd, POLLIN, 0 };
+
+	while ( ! __atomic_load_n( &stopping, __ATOMIC_ACQUIRE ) )
+		if ( ! drain() )
+			poll( &pfd, 1, 100 );
+
+	drain();
+
+	return NULL;
+}
+
+/**
+ * Start printing queued messages. The thread is plain SCHED_OTHER whatever
+ * the caller's priority, and takes no signals.
+ */
+void
+log_start ( void )
+{
+	struct sched_param sp;
+	pthread_attr_t attr;
+	sigset_t all, old;
+
+	if ( started )
+		return;
+
+	if ( -1 == ( wakefd = eventfd( 0, EFD_CLOEXEC ) ) )
+	{
+		perror( "eventfd()" );
+		fprintf( stderr, "Couldn't start logging thread, diagnostics will be lost!\n" );
+		return;
+	}
+
+	memset( &sp, 0, sizeof( sp ) );
+
+	pthread_attr_init( &attr );
+	pthread_attr_setinheritsched( &attr, PTHREAD_EXPLICIT_SCHED );
+	pthread_attr_setschedpolicy( &attr, SCHED_OTHER );
+	pthread_attr_setschedparam( &attr, &sp );
+
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+
+	if ( pthread_create( &thread, &attr, log_thread, NULL ) == 0 )
+		started = 1;
+	else
+	{
+		fprintf( stderr, "Couldn't start logging thread, diagnostics will be lost!\n" );
+		close( wakefd );
+		wakefd = -1;
+	}
+
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+	pthread_attr_destroy( &attr );
+}
+
+/**
+ * Print whatever is still queued and stop the thread, waking it rather than
+ * waiting out its idle poll
+ */
+void
+log_stop ( void )
+{
+	uint64_t one = 1;
+
+	if ( ! started )
+		return;
+
+	__atomic_store_n( &stopping, 1, __ATOMIC_RELEASE );
+
+	if ( write( wakefd, &one, sizeof( one ) ) != sizeof( one ) )
+		perror( "eventfd write()" );
+
+	pthread_join( thread, NULL );
+
+	close( wakefd );
+	wakefd = -1;
+	started = 0;
+
+	if ( log_dropped )
+		fprintf( stderr, "%lu log messages dropped\n", log_dropped );
+}
@@ -0,0 +1,8 @@
+#define LOG_RECORDS 1024							/* ring size, a power of two */
+
+extern unsigned long log_dropped;
+
+void log_msg __P(( FILE *fp, const char *fmt, int a, int b ));
+void log_str __P(( FILE *fp, const char *fmt, const char *s ));
+void log_start __P(( void ));
+void log_stop __P(( void ));
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#include <alsa/asoundlib.h>
+#include <linux/input.h>
+
+#include "seq.h"
+#include "sig.h"
+#include "loop.h"
+#include "driver.h"
+#include "lat.h"
+#include "input.h"
+#include "replay.h"
+#include "log.h"
+#ifdef USE_IO_URING
+#include "ring.h"
+#endif
+
+#define MAX_WATCHES 32
+#define MAX_DRIVERS 16
+#define MAX_FILE_WATCHES 8
+
+int daemonize = 0;
+const char *port_name = "Output";
+
+/* an fd in the epoll set */
+struct watch_s {
+	int fd;
+	watch_f f;
+	void *arg;
+};
+
+/* a file whose replacement we're told of */
+struct file_watch_s {
+	int wd;											/* on its directory */
+	char name[ NAME_MAX + 1 ];
+	watch_file_f f;
+	void *arg;
+	int changed;
+};
+
+static struct watch_s watches[ MAX_WATCHES ];
+static struct file_watch_s file_watches[ MAX_FILE_WATCHES ];
+static struct driver_s *drivers[ MAX_DRIVERS ];
+static int ndrivers = 0;
+static int epfd = -1;
+static int infd = -1;									/* inotify */
+
+/**
+ * Call /f/ with /arg/ whenever /fd/ becomes readable. Returns -1 on error.
+ */
+int
+watch_fd ( int fd, watch_f f, void *arg )
+{
+	struct epoll_event ee;
+	int i;
+
+	if ( epfd < 0 && ( epfd = epoll_create1( EPOLL_CLOEXEC ) ) < 0 )
+		return -1;
+
+	for ( i = 0; i < MAX_WATCHES; i++ )
+		if ( ! watches[i].f )
+			break;
+
+	if ( i == MAX_WATCHES )
+		return -1;
+
+	memset( &ee, 0, sizeof( ee ) );
+	ee.events = EPOLLIN;
+	ee.data.ptr = &watches[i];
+
+	if ( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ee ) < 0 )
+		return -1;
+
+	watches[i].fd = fd;
+	watches[i].f = f;
+	watches[i].arg = arg;
+
+	return 0;
+}
+
+/**
+ * Stop watching /fd/. Safe to call from within a watch callback.
+ */
+void
+unwatch_fd ( int fd )
+{
+	int i;
+
+	for ( i = 0; i < MAX_WATCHES; i++ )
+		if ( watches[i].f && watches[i].fd == fd )
+		{
+			epoll_ctl( epfd, EPOLL_CTL_DEL, fd, NULL );
+			watches[i].f = NULL;
+		}
+}
+
+/**
+ * Pass on the changes to watched files inotify has ready, once for each file
+ * however many there were
+ */
+static void
+files_changed ( int fd, void *arg )
+{
+	char buf[ 4096 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+	struct file_watch_s *w;
+	struct inotify_event *e;
+	ssize_t len;
+	char *p;
+
+	if ( ( len = read( infd, buf, sizeof( buf ) ) ) <= 0 )
+		return;
+
+	for ( p = buf; p < buf + len; p += sizeof( *e ) + e->len )
+	{
+		e = (struct inotify_event*)p;
+
+		for ( w = file_watches; w < file_watches + MAX_FILE_WATCHES; w++ )
+			if ( w->f && w->wd == e->wd && e->len && ! strcmp( w->name, e->name ) )
+				w->changed = 1;
+	}
+
+	for ( w = file_watches; w < file_watches + MAX_FILE_WATCHES; w++ )
+		if ( w->f && w->changed )
+		{
+			w->changed = 0;
+			w->f( w->name, w->arg );
+		}
+}
+
+/**
+ * Call /f/ with /arg/ whenever file /path/ has been written or replaced (by
+ * renaming another over it, as editors and keydb_save() do). The directory is
+ * watched, so the file needn't exist yet. Returns a handle for
+ * unwatch_file(), or -1 on error.
+ */
+int
+watch_file ( const char *path, watch_file_f f, void *arg )
+{
+	char dir[ PATH_MAX ];
+	const char *name = strrchr( path, '/' );
+	int i;
+
+	if ( infd < 0 )
+	{
+		if ( ( infd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC ) ) < 0 )
+			return -1;
+
+		if ( watch_fd( infd, files_changed, NULL ) < 0 )
+		{
+			close( infd );
+			infd = -1;
+			return -1;
+		}
+	}
+
+	for ( i = 0; i < MAX_FILE_WATCHES; i++ )
+		if ( ! file_watches[i].f )
+			break;
+
+	if ( i == MAX_FILE_WATCHES )
+		return -1;
+
+	if ( name )
+		snprintf( dir, sizeof( dir ), "%.*s", name == path ? 1 : (int)( name - path ), path );
+	else
+		strcpy( dir, "." );
+
+	name = name ? name + 1 : path;
+
+	if ( strlen( name ) > NAME_MAX ||
+		 ( file_watches[i].wd = inotify_add_watch( infd, dir, IN_CLOSE_WRITE | IN_MOVED_TO ) ) < 0 )
+		return -1;
+
+	strcpy( file_watches[i].name, name );
+	file_watches[i].f = f;
+	file_watches[i].arg = arg;
+	file_watches[i].changed = 0;
+
+	return i;
+}
+
+/**
+ * Stop watching the file watch_file() returned /w/ for
+ */
+void
+unwatch_file ( int w )
+{
+	int i;
+
+	if ( w < 0 || ! file_watches[w].f )
+		return;
+
+	file_watches[w].f = NULL;
+
+	/* the directory's watch is shared with any other file in it */
+	for ( i = 0; i < MAX_FILE_WATCHES; i++ )
+		if ( file_watches[i].f && file_watches[i].wd == file_watches[w].wd )
+			return;
+
+	inotify_rm_watch( infd, file_watches[w].wd );
+}
+
+/**
+ * Initialize driver /d/ with its own commandline. seq must already be open.
+ */
+void
+start_driver ( struct driver_s *d, int argc, char **argv )
+{
+	if ( ndrivers == MAX_DRIVERS )
+	{
+		fprintf( stderr, "Too many drivers!\n" );
+		exit( 1 );
+	}
+
+	d->opts.latency = -1;
+	d->opts.out_buffer = -1;
+	d->port = -1;
+	d->hotplug = -1;
+	d->losses = 0;
+	d->lost_at = d->down_us = 0;
+
+	/* rescan options from the start of this driver's argv */
+	optind = 0;
+
+	d->configure( argc, argv );
+
+	d->running = 1;
+	drivers[ ndrivers++ ] = d;
+}
+
+/**
+ * Shut down driver /d/, if it's running.
+ */
+void
+stop_driver ( struct driver_s *d )
+{
+	if ( ! d->running )
+		return;
+
+	d->running = 0;
+
+	if ( d->shutdown )
+		d->shutdown();
+
+	close_driver_input( d );
+}
+
+/**
+ * Print what there is to tell about the session to /fp/: on exit, and on
+ * SIGUSR1
+ */
+void
+reports ( FILE *fp )
+{
+	int i;
+
+	for ( i = 0; i < ndrivers; i++ )
+		replay_report( drivers[i]->replay, drivers[i]->name, fp );
+
+	lat_dump( fp );
+	input_report( fp );
+
+	for ( i = 0; i < ndrivers; i++ )
+		driver_report( drivers[i], fp );
+}
+
+/**
+ * Shut down in order on signal /sig/: silence every port, let go of the
+ * devices, and close the client. Called from the main loop, never from a
+ * handler.
+ */
+void
+die ( int sig )
+{
+	int i;
+
+	fprintf( stderr, "caught signal %d, cleaning up...\n", sig );
+
+	for ( i = 0; i < ndrivers; i++ )
+		if ( drivers[i]->running && drivers[i]->port >= 0 )
+		{
+			/* nothing the driver still has waiting may follow the reset */
+			if ( drivers[i]->reset )
+				drivers[i]->reset();
+
+			all_notes_off( drivers[i]->port, 1 );
+		}
+
+	for ( i = 0; i < ndrivers; i++ )
+		stop_driver( drivers[i] );
+
+	close_client();
+
+	/* the figures as they stand, before waiting on anything */
+	reports( stderr );
+
+	log_stop();
+
+	exit( 1 );
+}
+
+/**
+ * Dispatch events to the running drivers until they have all stopped.
+ */
+void
+run ( void )
+{
+	struct epoll_event ee[ MAX_WATCHES ];
+
+	if ( daemonize )
+	{
+		printf( "Running as daemon...\n" );
+		if ( fork() )
+			exit( 0 );
+		else
+		{
+			fclose( stdout );
+			fclose( stderr );
+		}
+	}
+
+	/* nowhere to print diagnostics to once daemonized */
+	if ( ! daemonize )
+		log_start();
+
+	fprintf( stderr, "Waiting for events...\n" );
+
+	for ( ;; )
+	{
+		int i, n, running = 0;
+		int timeout = -1;
+
+		for ( i = 0; i < ndrivers; i++ )
+		{
+			int t;
+
+			if ( ! drivers[i]->running )
+				continue;
+
+			running++;
+
+			if ( drivers[i]->timeout &&
+				 ( t = drivers[i]->timeout() ) >= 0 &&
+				 ( timeout < 0 || t < timeout ) )
+				timeout = t;
+		}
+
+		if ( ! running )
+		{
+			reports( stderr );
+			log_stop();
+			break;
+		}
+
+#ifdef USE_IO_URING
+		/* re-arm the reads the last round used up */
+		ring_submit();
+#endif
+
+		n = epoll_wait( epfd, ee, MAX_WATCHES, timeout );
+
+		if ( n < 0 )
+		{
+			if ( errno != EINTR )
+				perror( "epoll_wait()" );
+			continue;
+		}
+
+		if ( n == 0 )
+		{
+			/* timed out, fire whoever was due */
+			for ( i = 0; i < ndrivers; i++ )
+				if ( drivers[i]->running && drivers[i]->timeout &&
+					 drivers[i]->timeout() == timeout )
+				{
+					lat_clear();
+					drivers[i]->timer();
+				}
+
+			continue;
+		}
+
+		for ( i = 0; i < n; i++ )
+		{
+			struct watch_s *w = ee[i].data.ptr;
+
+			/* may have been unwatched by an earlier callback. Input is
+			 * stamped as it's read, anything else ages from nothing. */
+			if ( w->f )
+			{
+				lat_clear();
+				w->f( w->fd, w->arg );
+			}
+		}
+	}
+}
+
+/**
+ * Run driver /d/ as a process of its own, with its own ALSA client.
+ */
+int
+driver_main ( struct driver_s *d, int argc, char **argv )
+{
+	fprintf( stderr, "lsmi-%s v%s\n", d->name, d->version );
+
+	client_name = d->client_name;
+
+	set_traps();
+
+	start_driver( d, argc, argv );
+
+	run();
+
+	close_client();
+
+	return 0;
+}
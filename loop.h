@@ -0,0 +1,66 @@
+
+struct input_event;
+struct input_s;
+struct replay_s;
+
+/* options every driver takes, see driver_option() */
+struct driver_opts_s {
+	char *sub_name;									/* subscriber, or NULL */
+	char *rawmidi;									/* rawmidi device, instead of a port */
+	int latency;									/* uS from input to delivery, or -1 */
+	int out_buffer;									/* output buffer size, or -1 */
+	char *record_file;
+	char *replay_file;
+	int replay_repeat;								/* 0 = real time */
+};
+
+/* a driver, as run by lsmi (from a plugin) or standalone */
+struct driver_s {
+	const char *name;								/* as given to lsmi */
+	const char *client_name;						/* ALSA client, when alone */
+	const char *version;
+
+	int (*probe) __P(( int fd ));					/* whether the device suits, or NULL */
+	void (*configure) __P(( int argc, char **argv ));	/* parse args, open device */
+	void (*frame) __P(( struct input_event *frame, int n ));	/* or NULL */
+	int (*timeout) __P(( void ));					/* mS until timer(), or -1 */
+	void (*timer) __P(( void ));
+	void (*shutdown) __P(( void ));
+	void (*attached) __P(( int fd ));				/* a hotplugged device came back, or NULL */
+	void (*reset) __P(( void ));					/* drop what's held before the port is reset, or NULL */
+
+	/* kept by the core */
+	int running;
+	int port;										/* from open_driver_port(), or -1 */
+	struct driver_opts_s opts;
+	struct input_s *input;							/* from open_driver_input(), or NULL */
+	struct replay_s *replay;						/* from replay_open(), or NULL */
+
+	/* to open the device again when it comes back, see hotplug.c */
+	const char *match;								/* its node, or a match spec */
+	int match_flags;
+	struct input_s *match_input;					/* to attach it to */
+	char node[ 32 ];								/* the one attached */
+	int hotplug;									/* hotplug_watch() handle */
+
+	/* the device going away */
+	int losses;
+	long long lost_at;								/* uS, or 0 while it's there */
+	long long down_us;								/* in all, before lost_at */
+};
+
+typedef void (*watch_f) __P(( int fd, void *arg ));
+typedef void (*watch_file_f) __P(( const char *name, void *arg ));
+
+extern int daemonize;
+extern const char *port_name;
+
+int watch_fd __P(( int fd, watch_f f, void *arg ));
+void unwatch_fd __P(( int fd ));
+int watch_file __P(( const char *path, watch_file_f f, void *arg ));
+void unwatch_file __P(( int w ));
+void start_driver __P(( struct driver_s *d, int argc, char **argv ));
+void stop_driver __P(( struct driver_s *d ));
+void run __P(( void ));
+void reports __P(( FILE *fp ));
+int driver_main __P(( struct driver_s *d, int argc, char **argv ));
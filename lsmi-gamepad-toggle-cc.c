@@ -27,7 +27,8 @@
  *
  * How does it work?
  * 
- * It tries to load the keymap file (~/.keydb).
+ * It tries to load the keymap file (~/.keydb-gamepad, or a ~/.keydb from an
+ * older version).
  * If it does not exist, a little wizard asks you to configure you gamepad buttons.
  * Your buttons finally send CC messages in range 13 to 13+[N buttons]
  */
@@ -53,30 +54,35 @@
 
 #include "seq.h"
 #include "sig.h"
+#include "input.h"
+#include "loop.h"
+#include "driver.h"
+#include "log.h"
+#include "keydb.h"
 
 #define testbit(bit, array)    (array[bit/8] & (1<<(bit%8)))
+#define setbit(bit, array)    (array[bit/8] |= (1<<(bit%8)))
+#define clearbit(bit, array)    (array[bit/8] &= ~(1<<(bit%8)))
 
 #define CLIENT_NAME "USB-Gamepad CC Toggler"
 #define VERSION "0.1"
 #define DOWN 1
 #define UP 0
 
-char defaultdatabase[] = ".keydb";
-char *database = defaultdatabase;
+static char defaultdatabase[] = ".keydb-gamepad";
+static char legacydatabase[] = ".keydb";				/* shared with keyhack, once */
+static char *database = defaultdatabase;
 
-int verbose = 0;
-int channel = 0;
+static int channel = 0;
 
-int fd;
+static struct input_s input;
 
-snd_seq_t *seq = NULL;
-int port;
-struct timeval timeout;
+extern struct driver_s gamepad_driver;
 
-char *sub_name = NULL;								/* subscriber */
+static int port;
 
-char defaultdevice[] = "/dev/input/event0";
-char *device = defaultdevice;
+static char defaultdevice[] = "/dev/input/event0";
+static char *device = defaultdevice;
 
 enum control_keys
 {
@@ -96,95 +102,123 @@ struct map_s {
 	bool active;
 };
 
-struct map_s map[KEY_MAX];
-
-int
-open_database ( char *filename )
-{
-	int dbfd;
+/* everything taken from the key database, built aside and flipped in whole
+ * when it changes */
+struct keymap_s {
+	struct map_s map[KEY_MAX];
+	snd_seq_event_t templates[KEY_MAX];	/* each button's controller, ready to send */
+};
 
-	if ( -1 == ( dbfd = open( filename, O_RDONLY ) ) )
-		return -1;
-	
-	read( dbfd, map, sizeof ( map ) );
+static struct keymap_s keymaps[2];
+static struct keymap_s *km = &keymaps[0];	/* the one in use */
 
-	close( dbfd );
+static int dbwatch = -1;					/* on the database, for reload */
 
-	return 0;
-}
+static uint8_t down[ KEY_MAX / 8 + 1 ];		/* buttons we've acted on as down */
 
-int
-close_database ( char *filename )
+/**
+ * Load the key map from /filename/ into /k/. Returns -1 if it's missing or
+ * invalid.
+ */
+static int
+open_database ( char *filename, struct keymap_s *k )
 {
-	int dbfd;
+	struct keydb_s db;
+	int i;
+
+	switch ( keydb_load( &db, filename, KEYDB_GAMEPAD ) )
+	{
+		case 0:
+			break;
+		case -2:
+			/* from before the database had a format of its own */
+			if ( keydb_load_raw( filename, k->map, sizeof( k->map ) ) == 0 )
+			{
+				fprintf( stderr, "Converting old key database (it will be saved in the new format on EXIT)\n" );
+				return 0;
+			}
+			/* fall through */
+		default:
+			return -1;
+	}
 
-	if ( -1 == ( dbfd = creat( filename, 0666 ) ) )	
-		return -1;
-	
-	write( dbfd, map, sizeof ( map ) );
+	for ( i = 0; i < db.count; i++ )
+	{
+		const struct keydb_entry_s *e = &db.entries[i];
 
-	close( dbfd );
+		if ( e->code >= KEY_MAX )
+			continue;
+
+		k->map[ e->code ].control = e->control;
+		k->map[ e->code ].ev_type = e->ev_type;
+		k->map[ e->code ].number = e->number;
+		k->map[ e->code ].active = e->flags & KEYDB_ACTIVE ? true : false;
+	}
+
+	keydb_unload( &db );
 
 	return 0;
 }
 
 /**
- * Prepare to die gracefully
+ * Save the mapped keys to /filename/
  */
-void
-clean_up( void )
+static int
+close_database ( char *filename )
 {
-	/* release the keyboard */
-	ioctl( fd, EVIOCGRAB, 0 );
+	static struct keydb_entry_s entries[ KEY_MAX ];
+	int i, n = 0;
 
-	close( fd );
+	for ( i = 0; i < KEY_MAX; i++ )
+	{
+		if ( ! km->map[i].control && ! km->map[i].ev_type )
+			continue;
 
-	snd_seq_close( seq );
-}
+		memset( &entries[n], 0, sizeof( entries[n] ) );
 
-/** 
- * Signal handler
- */
-void
-die( int x )
-{
-  printf( "caught signal %d, cleaning up...\n", x );
-  clean_up();
-  exit( 1 );
+		entries[n].code = i;
+		entries[n].control = km->map[i].control;
+		entries[n].ev_type = km->map[i].ev_type;
+		entries[n].number = km->map[i].number;
+		entries[n].flags = km->map[i].active ? KEYDB_ACTIVE : 0;
+
+		n++;
+	}
+
+	return keydb_save( filename, KEYDB_GAMEPAD, entries, n );
 }
 
 /** 
  * print help
  */
-void
+static void
 usage ( void )
 {
 	fprintf( stderr, "Usage: lsmi-gamepad-toggle-cc [options]\n"
 	"Options:\n\n"
 		" -h | --help                   Show this message\n"
-		" -d | --device specialfile     Event device to use (instead of event0)\n"
-		" -v | --verbose                Be verbose (show cc events)\n"
+		" -d | --device specialfile     Event device to use (instead of event0), or one to wait\n"
+		"                               for: name=pattern, id=vendor:product or phys=pattern\n"
 		" -c | --channel n              Initial MIDI channel\n"
-		" -p | --port client:port       Connect to ALSA Sequencer client on startup\n"					
-		" -k | --keydata file			Name file to read/write key mappings (instead of ~/.keydb)\n"
+		DRIVER_USAGE
+		" -k | --keydata file			Name file to read/write key mappings (instead of ~/.keydb-gamepad)\n"
 	"\n" );
 }
 
 /** 
  * process commandline arguments
  */
-void
+static void
 get_args ( int argc, char **argv )
 {
-	const char *short_opts = "hp:c:d:k:v";
+	const char *short_opts = "h" DRIVER_OPTS "c:d:k:";
 	const struct option long_opts[] =
 	{
 		{ "help", no_argument, NULL, 'h' },
-		{ "port", required_argument, NULL, 'p' },
+		DRIVER_LONG_OPTS,
 		{ "channel", required_argument, NULL, 'c' },
 		{ "device", required_argument, NULL, 'd' },
 		{ "keydata", required_argument, NULL, 'k' },
-		{ "verbose", no_argument, NULL, 'v' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -196,12 +230,9 @@ get_args ( int argc, char **argv )
 		switch (c)
 		{
 			case 'h':
-				fprintf( stderr, "Help\n" );
+				usage();
 				exit(0);
 				break;
-			case 'p':
-				sub_name = optarg;
-				break;
 			case 'c':
 				channel = atoi( optarg );
 
@@ -220,8 +251,9 @@ get_args ( int argc, char **argv )
 				break;
 			case 'k':
 				database = optarg;
-			case 'v':
-				verbose = 1;
+				break;
+			default:
+				driver_option( &gamepad_driver, c, optarg );
 				break;
 		}
 
@@ -231,24 +263,37 @@ get_args ( int argc, char **argv )
 /** 
  * Block until keypress (down or up) is ready. Return raw key
  */
-int
+static int
 get_keypress ( int *state )
 {
-	struct input_event iev;
-	int keyi;
-	
+	static struct input_event *frame;
+	static int n, i;
+
 	for ( ;; )
 	{
-		read( fd, &iev, sizeof( iev ) );
+		while ( i < n )
+		{
+			struct input_event *iev = &frame[ i++ ];
 
-		if ( iev.type != EV_KEY ||
-			 iev.value == 2 )
-			continue;
-	
-		*state = iev.value == 0 ? UP : DOWN;
-		keyi = iev.code;
+			if ( iev->type != EV_KEY ||
+				 iev->value == 2 )
+				continue;
 
-		return keyi;
+			*state = iev->value == 0 ? UP : DOWN;
+
+			return iev->code;
+		}
+
+		i = 0;
+		n = input_read_frame( &input, &frame );
+
+		/* nothing to wait for it to come back to */
+		if ( n == 0 || ( n < 0 && errno != EINTR ) )
+		{
+			fprintf( stderr, "Lost the gamepad while learning! (%s)\n",
+					 n ? strerror( errno ) : "end of file" );
+			exit( 1 );
+		}
 	}
 }
 
@@ -256,7 +301,7 @@ get_keypress ( int *state )
  * Get complete key (press and release), ignoring other releases. Return key
  * index
  */
-int
+static int
 get_key( void )
 {
 	int key;
@@ -274,35 +319,27 @@ get_key( void )
 }
 
 /** 
- * Initialize event and uinput keyboard interfaces */
-void
-init_keyboard ( void )
+ * Whether the event device open on /fd/ reports keys the way a (USB HID)
+ * gamepad does
+ */
+static int
+gamepad_probe ( int fd )
 {
   	uint8_t evt[EV_MAX / 8 + 1];
 
+	memset( evt, 0, sizeof( evt ) );
+
 	/* get capabilities */
 	ioctl( fd, EVIOCGBIT( 0, sizeof(evt)), evt );
 
-	if ( ! ( testbit( EV_KEY, evt ) &&
-			 testbit( EV_MSC, evt ) ) )
-	{
-		fprintf( stderr, "'%s' doesn't seem to be a keyboard! look in /proc/bus/input/devices to find the name of your keyboard's event device\n", device );
-		exit( 1 );
-	}
-
-	/* exclusive access */
-	if ( ioctl( fd, EVIOCGRAB, 1 ) )
-	{
-		perror( "EVIOCGRAB" );
-		exit(1);
-	}
+	return testbit( EV_KEY, evt ) && testbit( EV_MSC, evt );
 }
 
 
 /** 
  * Prompt for learning input. Build key database.
  */
-void
+static void
 learn_mode ( void )
 {
 	int keyi;
@@ -312,7 +349,7 @@ learn_mode ( void )
 
 	printf( "Press the key that shall henceforth be known as EXIT\n" );
 	keyi = get_key();
-	map[keyi].control = CKEY_EXIT;
+	km->map[keyi].control = CKEY_EXIT;
 
 	printf( "Press each button in succession, beginning with the left-most. When you run out of buttons, or do not want to assign all buttons, press the first one again.\n" );
 	for ( ;; )
@@ -327,10 +364,10 @@ learn_mode ( void )
 			learn_firstkey = keyi;
 		
 		printf( "CC message number to send: %i, USB button key: %i ", 13 + learn_note, keyi );
-		map[keyi].control = CKEY_NUMERIC;
-		map[keyi].ev_type = SND_SEQ_EVENT_CONTROLLER;
-		map[keyi].number  = 13 + learn_note++;
-		map[keyi].active = false;
+		km->map[keyi].control = CKEY_NUMERIC;
+		km->map[keyi].ev_type = SND_SEQ_EVENT_CONTROLLER;
+		km->map[keyi].number  = 13 + learn_note++;
+		km->map[keyi].active = false;
 
 		learn_keys++;
 	}
@@ -339,122 +376,285 @@ learn_mode ( void )
 }
 
 
-/** main 
- *
+/**
+ * Have the kernel hold back everything but the mapped buttons, so axes and
+ * unmapped buttons don't wake us
  */
-int
-main ( int argc, char **argv )
-{	
+static void
+mask_events ( void )
+{
+	uint8_t types[ EV_MAX / 8 + 1 ];
+	uint8_t keys[ KEY_MAX / 8 + 1 ];
+	int i;
+
+	memset( types, 0, sizeof( types ) );
+	memset( keys, 0, sizeof( keys ) );
+
+	setbit( EV_SYN, types );
+	setbit( EV_KEY, types );
+
+	for ( i = 0; i < KEY_MAX; i++ )
+		if ( km->map[i].control || km->map[i].ev_type )
+			setbit( i, keys );
+
+	if ( input_mask( &input, EV_KEY, keys, sizeof( keys ) ) < 0 ||
+		 input_mask( &input, 0, types, sizeof( types ) ) < 0 )
+		fprintf( stderr, "Kernel can't mask events, unmapped ones will be ignored instead\n" );
+}
+
+/**
+ * Act on a button going up or down
+ */
+static void
+handle_key ( int keyi, int newstate )
+{
 	snd_seq_event_t ev;
 
-	fprintf( stderr, "lsmi-gamepad-toggle-cc" " v" VERSION "\n" );
+	if ( km->map[keyi].control == CKEY_EXIT ) {
+		if ( newstate == UP )
+			return;
 
-	get_args( argc, argv );
+		snd_seq_ev_clear( &ev );
 
-	fprintf( stderr, "Registering MIDI port...\n" );
+		snd_seq_ev_set_controller( &ev, channel, 123, 0 );
+		send_event( port, &ev );
+		snd_seq_ev_clear( &ev );
+		flush_events();
 
-	seq = open_client( CLIENT_NAME );
+		fprintf( stderr, "Exiting...\n" );
 
-	if ( NULL == seq )
-	{
-		fprintf( stderr, "Error opening alsa sequencer!\n" );
-		exit( 1 );
+		if ( close_database( database ) < 0 )
+			fprintf( stderr, "Error saving database!\n" );
+
+		stop_driver( &gamepad_driver );
+
+		return;
 	}
+	else {
+		switch ( km->map[keyi].ev_type )
+		{
+			case SND_SEQ_EVENT_CONTROLLER:
+				if (newstate == DOWN) {
+					km->map[keyi].active = !km->map[keyi].active;
+					send_value( &km->templates[keyi], km->map[keyi].active ? 127 : 0 );
+				}
 
-	if ( ( port = open_output_port( seq ) ) < 0 )
-	{
-		fprintf( stderr, "Error opening MIDI output port!\n" );
-		exit( 1 );
+				break;
+
+			default:
+				log_msg( stderr,
+						 "Key has invalid mapping!\n", 0, 0 );
+				break;
+		}
 	}
+}
+
+/**
+ * Act on button /keyi/ going /newstate/, unless it's already there
+ */
+static void
+key_event ( int keyi, int newstate )
+{
+	if ( keyi >= KEY_MAX || ! testbit( keyi, down ) == ( newstate == UP ) )
+		return;
+
+	if ( newstate == DOWN )
+		setbit( keyi, down );
+	else
+		clearbit( keyi, down );
+
+	handle_key( keyi, newstate );
+}
 
-	if ( sub_name )
+/**
+ * The kernel dropped events: bring the mapped buttons into line with the
+ * gamepad. A button found down that we last saw up was pressed meanwhile, so
+ * it toggles now (EXIT aside, which is too late to act on). A press and
+ * release both lost can't be told from nothing having happened.
+ */
+static void
+resync_keys ( void )
+{
+	uint8_t keys[ KEY_MAX / 8 + 1 ];
+	int i;
+
+	input_keys( &input, keys, sizeof( keys ) );
+
+	for ( i = 0; i < KEY_MAX; i++ )
 	{
-		snd_seq_addr_t addr;
+		if ( ! ( km->map[i].control || km->map[i].ev_type ) ||
+			 ! testbit( i, keys ) == ! testbit( i, down ) )
+			continue;
 
-		if ( snd_seq_parse_address( seq, &addr, sub_name ) < 0 )
-			fprintf( stderr, "Couldn't parse address '%s'", sub_name );
+		if ( km->map[i].control == CKEY_EXIT && testbit( i, keys ) )
+			setbit( i, down );
 		else
-		if ( snd_seq_connect_to( seq, port, addr.client, addr.port ) < 0 )
-		{
-			fprintf( stderr, "Error creating subscription for port %i:%i", addr.client, addr.port );
-			exit( 1 );
-		}
+			key_event( i, testbit( i, keys ) ? DOWN : UP );
 	}
 
-	fprintf( stderr, "Initializing keyboard...\n" );
-	if ( -1 == ( fd = open( device, O_RDWR ) ) )
+	flush_events();
+}
+
+/**
+ * Handle a frame from the gamepad
+ */
+static void
+gamepad_frame ( struct input_event *frame, int n )
+{
+	int i;
+
+	for ( i = 0; i < n; i++ )
+		if ( frame[i].type == EV_KEY &&
+			 frame[i].value != 2 )
+			key_event( frame[i].code, frame[i].value == 0 ? UP : DOWN );
+}
+
+/**
+ * Make the controller templates for /k/'s buttons
+ */
+static void
+compile_map ( struct keymap_s *k )
+{
+	int i;
+
+	for ( i = 0; i < KEY_MAX; i++ )
+		if ( k->map[i].ev_type == SND_SEQ_EVENT_CONTROLLER )
+			event_template( &k->templates[i], port, SND_SEQ_EVENT_CONTROLLER,
+							channel, k->map[i].number, 0 );
+}
+
+/**
+ * The key database changed on disk: build the new map aside and flip to it,
+ * between frames. A button still on the same controller keeps its toggle as
+ * the receiver last heard it.
+ */
+static void
+reload_database ( const char *name, void *arg )
+{
+	struct keymap_s *k = &keymaps[ km == keymaps ];
+	int i;
+
+	memset( k, 0, sizeof( *k ) );
+
+	if ( -1 == open_database( database, k ) )
 	{
-		fprintf( stderr, "Error opening event interface! (%s)\n", strerror( errno ) );
-		exit(1);
+		fprintf( stderr, "Key database '%s' is invalid, keeping the old one\n", database );
+		return;
 	}
-	init_keyboard();
 
-	set_traps();
+	for ( i = 0; i < KEY_MAX; i++ )
+		if ( k->map[i].ev_type == SND_SEQ_EVENT_CONTROLLER &&
+			 km->map[i].ev_type == SND_SEQ_EVENT_CONTROLLER &&
+			 k->map[i].number == km->map[i].number )
+			k->map[i].active = km->map[i].active;
+
+	compile_map( k );
+
+	km = k;
+
+	/* or when it's plugged back in */
+	if ( ! gamepad_driver.opts.replay_file && gamepad_driver.input )
+		mask_events();
+
+	fprintf( stderr, "Reloaded key database '%s'\n", database );
+}
+
+/**
+ * Stop watching the database
+ */
+static void
+clean_up ( void )
+{
+	unwatch_file( dbwatch );
+}
+
+/**
+ * The gamepad was plugged back in
+ */
+static void
+gamepad_attached ( int fd )
+{
+	mask_events();
+}
+
+/**
+ * Parse arguments, register our port, open the gamepad and load (or learn) the
+ * key database
+ */
+static void
+gamepad_init ( int argc, char **argv )
+{	
+	int loaded, fd;
+
+	get_args( argc, argv );
+
+	port = open_driver_port( &gamepad_driver );
+
+	fprintf( stderr, "Initializing keyboard...\n" );
+
+	fd = open_driver_input( &gamepad_driver, &input, device, INPUT_WRITE | INPUT_GRAB );
 
 	fprintf( stderr, "Opening database...\n" );
 	if ( database == defaultdatabase )
 	{
 		char *home = getenv( "HOME" );
+		char *legacy = malloc( strlen( home ) + strlen( legacydatabase ) + 2 );
+
 		database = malloc( strlen( home ) + strlen( defaultdatabase ) + 2 );
 		sprintf( database, "%s/%s", home, defaultdatabase );
+		sprintf( legacy, "%s/%s", home, legacydatabase );
+
+		/* a gamepad map saved where keyhack keeps its own */
+		if ( -1 == ( loaded = open_database( database, km ) ) &&
+			 0 == ( loaded = keydb_load_raw( legacy, km->map, sizeof( km->map ) ) ) )
+			fprintf( stderr, "Using old key database '%s' (it will be saved as '%s' on EXIT)\n", legacy, database );
+
+		free( legacy );
 	}
+	else
+		loaded = open_database( database, km );
 
-	if ( -1 == open_database( database ) )
+	if ( -1 == loaded )
 	{
+		if ( fd < 0 )
+		{
+			fprintf( stderr, "Key database missing or invalid, and no gamepad to learn from!\n" );
+			exit( 1 );
+		}
+
 		fprintf( stderr, "******Key database missing or invalid******\n"
 						 "Entering learning mode...\n"
 						 "Make sure your device is connected!\n" );
 		learn_mode();
 	}
 
-	fprintf( stderr, "Waiting for events...\n" );
+	compile_map( km );
 
-	for ( ;; )
-	{	
-		int keyi, newstate;
+	/* learning needs to see every button */
+	if ( ! gamepad_driver.opts.replay_file && fd >= 0 )
+		mask_events();
 
-		keyi = get_keypress( &newstate );
-		
-		snd_seq_ev_clear( &ev );
-
-		if ( map[keyi].control == CKEY_EXIT ) {
-			if ( newstate == UP )
-				continue;
-
-			snd_seq_ev_set_controller( &ev, channel, 123, 0 );
-			send_event( &ev );
-			snd_seq_ev_clear( &ev );
-
-			fprintf( stderr, "Exiting...\n" );
+	/* pick up changes to the database as they're saved */
+	if ( -1 == ( dbwatch = watch_file( database, reload_database, NULL ) ) )
+		fprintf( stderr, "Can't watch key database, changes will need a restart\n" );
 
-			if ( close_database( database ) < 0 )
-				fprintf( stderr, "Error saving database!\n" );
-
-			clean_up();
+	input.resync = resync_keys;
+}
 
-			exit(0);
-		}
-		else {
-			switch ( map[keyi].ev_type )
-			{
-				case SND_SEQ_EVENT_CONTROLLER:
-					if (newstate == DOWN) {
-						snd_seq_ev_set_controller( &ev, channel,
-												    map[keyi].number,
-												    !map[keyi].active ? 127 : 0 );
-						map[keyi].active = !map[keyi].active;
-					}
-
-					break;
-
-				default:
-					fprintf( stderr,
-							 "Key has invalid mapping!\n" );
-					break;
-			}
-		}
+struct driver_s gamepad_driver = {
+	"gamepad-toggle-cc", CLIENT_NAME, VERSION,
+	gamepad_probe, gamepad_init, gamepad_frame, NULL, NULL, clean_up, gamepad_attached
+};
 
-		send_event( &ev );
-	}
+#ifdef LSMI_PLUGIN
+struct driver_s *lsmi_driver = &gamepad_driver;
+#else
+/** main 
+ *
+ */
+int
+main ( int argc, char **argv )
+{
+	return driver_main( &gamepad_driver, argc, argv );
 }
-
+#endif
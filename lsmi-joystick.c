@@ -22,106 +22,397 @@
  *
  * March, 2007
  *
- * This driver allows any joystick supported by the Linux joydev interface to
- * be used as a MIDI pitch/modulation controller. Of course, some joysticks are
+ * This driver allows any joystick supported by the Linux input layer to be
+ * used as a MIDI pitch/modulation controller. Of course, some joysticks are
  * more suitable than others. I use an old analog flight stick. Holding down
  * button 1 causes the vertical axis to send pitchbend messages, while button 2
  * causes the vertical axis to send modulation messages. Holding down both
  * buttons causes the vertical axis to send pitchbend messages and the
  * horizontal axis to send modulation messages. 
  *
- * 		
+ * That's the default map; any axis can be mapped to pitchbend, a controller
+ * or a 14 bit controller pair with -a, optionally only while certain buttons
+ * are held (the first map of an axis whose buttons are all held wins), and
+ * any button to a controller with -B. Buttons are numbered from 0, in the
+ * same order as the joydev interface numbers them.
+ *
+ * Example:
+ *
+ * 	The default map, spelled out:
+ *
+ * 	lsmi-joystick -a -y=bend@0 -a -y=c14:1@1 -a -x=c14:1@0+1
+ *
+ * 	Throttle as volume, and button 4 as a sustain pedal:
+ *
+ * 	lsmi-joystick -d /dev/input/event5 -a throttle=c:7 -B 4=c:64
+ *
+ * The device is read through its event interface (a js device given with -d
+ * is swapped for its event device), so that all the axes changed by one
+ * report from the stick are handled together, with the kernel's timestamps
+ * and axis ranges. The old js interface is still read if there is no event
+ * device to be had, and for replaying recordings made with it.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <dirent.h>
 #include <alsa/asoundlib.h>
+#include <linux/input.h>
 #include <linux/joystick.h>
 
+#include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <signal.h>
 #include <getopt.h>
 
 #include "seq.h"
 #include "sig.h"
+#include "input.h"
+#include "loop.h"
+#include "driver.h"
+#include "lat.h"
+#include "replay.h"
+#include "hotplug.h"
 
 #define elementsof(x) ( sizeof( (x) ) / sizeof( (x)[0] ) )
 #define min(x,min) ( (x) < (min) ? (min) : (x) )
 #define max(x,max) ( (x) > (max) ? (max) : (x) )
 
+#define testbit(bit, array)    (array[bit/8] & (1<<(bit%8)))
+
 #define CLIENT_NAME "Pseudo-MIDI Pitch/Mod-Wheel"
 #define VERSION "0.1"
 #define DOWN 1
 #define UP 0
 
+#define JS_BATCH 64									/* events per read() */
+
+#define MAX_OUTS 16
+#define MAX_AXIS_MAPS 32
+#define MAX_BUTTONS 32									/* that can be mapped */
+
 /* global options */
-int verbose = 0;
-int channel = 0;
-int nohold = 0;
-int daemonize = 0;
+static int channel = 0;
+static int nohold = 0;
+static int jitter = 8;										/* of 32767, to ignore */
+static int interval = 1000;									/* uS between sends of a controller */
+
+#define UNSENT -1
+
+/* kinds of output */
+enum { OUT_BEND, OUT_CC, OUT_CC14 };
+
+/* an output controlled by axes or buttons */
+struct out_s {
+	int type;
+	int number;												/* controller */
+	int last;												/* last sent, or UNSENT */
+	int pending;											/* to send when the interval is up, or UNSENT */
+	long long sent;											/* when last sent, in uS */
+	struct timeval stamp;									/* of the input pending came from */
+	int clock;
+	snd_seq_event_t ev[2];									/* ready to send (coarse, fine) */
+};
+
+/* an axis driving an output */
+struct axis_map_s {
+	int axis;												/* ABS_* */
+	int invert;
+	unsigned int hold;										/* buttons that must be held */
+	struct out_s *out;
+};
+
+/* state of an axis */
+struct axis_s {
+	int min, max;
+	int raw;
+	int changed;											/* in this frame */
+};
+
+static struct out_s outs[ MAX_OUTS ];
+static int nouts = 0;
+
+static struct axis_map_s axis_maps[ MAX_AXIS_MAPS ];
+static int naxis_maps = 0;
+
+static struct out_s *button_maps[ MAX_BUTTONS ];			/* or NULL */
+
+static struct axis_s axes[ ABS_CNT ];
+static unsigned int held = 0;								/* buttons */
+
+/* evdev key code to button number, or -1 */
+static signed char buttons[ KEY_CNT ];
+
+/* js axis number to ABS_* */
+static uint8_t js_axes[ ABS_CNT ];
+
+static int tfd = -1;										/* coalescing timer */
+static struct timeval in_stamp;								/* of the input being handled */
+static int in_clock = CLOCK_MONOTONIC;
+static long long armed = 0;									/* deadline it's armed for, in uS */
+
+static char defaultjoydevice[] = "/dev/input/js0";
+static char *joydevice = defaultjoydevice;
+static char evdevice[ 64 ];
+static int jfd;
+static int use_js = 0;										/* reading the js interface */
+static int js_watch = -1;									/* for it to come back */
+static struct input_s input;
+
+static struct record_s *record = NULL;
+
+extern struct driver_s joystick_driver;
 
-char defaultjoydevice[] = "/dev/input/js0";
-char *joydevice = defaultjoydevice;
-int jfd;
+static int port;
 
-snd_seq_t *seq = NULL;
-int port;
 
-char *sub_name;										/* subscriber */
+static void emit __P(( struct out_s *o, int value, long long now ));
+static long long now_us __P(( void ));
+static void js_input __P(( int fd, void *arg ));
 
 
-void
+static void
 clean_up( void )
 {
-  close( jfd );
-}
+  int i;
 
-void
-die( int x )
-{
-  printf( "caught signal %d, cleaning up...\n", x );
-  clean_up();
-  exit( 1 );
+  /* don't leave the receiver short of where the stick ended up */
+  for ( i = 0; i < nouts; i++ )
+	  if ( outs[i].pending != UNSENT )
+	  {
+		  lat_stamp( &outs[i].stamp, outs[i].clock );
+		  emit( &outs[i], outs[i].pending, now_us() );
+	  }
+
+  flush_events();
+
+  /* an event device is the core's to close */
+  if ( use_js && jfd >= 0 )
+  {
+	  unwatch_fd( jfd );
+	  close( jfd );
+  }
+
+  hotplug_unwatch( js_watch );
+
+  unwatch_fd( tfd );
+  close( tfd );
 }
 
-/** 
+/**
  * print help
  */
-void
+static void
 usage ( void )
 {
 	fprintf( stderr, "Usage: lsmi-joystick [options]\n"
 	"Options:\n\n"
 		" -h | --help                   Show this message\n"
-		" -d | --device specialfile     Event device to use (instead of js0)\n"
-		" -v | --verbose                Be verbose (show note events)\n"
-		" -p | --port client:port       Connect to ALSA Sequencer client on startup\n"					
-		" -n | --no-hold                Send controller data even when no joystick button is held\n" );
-	fprintf( stderr, 	" -z | --daemon                 Fork and don't print anything to stdout\n"
+		" -d | --device specialfile     Event (or js) device to use (instead of js0), or an event\n"
+		"                               device to wait for: name=pattern, id=vendor:product\n"
+		"                               or phys=pattern\n"
+		" -c | --channel n              MIDI channel\n"
+		DRIVER_USAGE
+		" -a | --axis [-]axis=out[@b[+b...]]\n"
+		"                               Map axis (x, y, z, rx, ry, rz, throttle, rudder, wheel,\n"
+		"                               gas, brake, hat0x, hat0y or a number) to out (bend,\n"
+		"                               c:controller or c14:controller for a 14 bit pair) while\n"
+		"                               buttons b... are held. A leading '-' inverts the axis.\n"
+		" -B | --button b=c:controller  Map button b to a controller, 127 when down and 0 when up\n"
+		" -n | --no-hold                Send controller data even when no joystick button is held\n"
+		" -j | --jitter n               Ignore axis movements smaller than n (of 32767, default 8)\n"
+		" -i | --interval uS            Send each controller at most once per interval, coalescing\n"
+		"                               the changes in between (default 1000, 0 = no limit)\n"
 	"\n" );
 }
 
+/**
+ * Return the output of /type/ and /number/, adding it if need be.
+ */
+static struct out_s *
+find_out ( int type, int number )
+{
+	struct out_s *o;
+	int i;
+
+	for ( i = 0; i < nouts; i++ )
+		if ( outs[i].type == type && outs[i].number == number )
+			return &outs[i];
+
+	if ( nouts == MAX_OUTS )
+	{
+		fprintf( stderr, "Too many outputs (at most %i)!\n", MAX_OUTS );
+		exit( 1 );
+	}
+
+	o = &outs[ nouts++ ];
+
+	o->type = type;
+	o->number = number;
+	o->last = o->pending = UNSENT;
+	o->sent = 0;
+
+	return o;
+}
+
+/**
+ * Parse output spec /s/ (bend, c:n or c14:n). Returns the output, or NULL if
+ * /s/ is invalid.
+ */
+static struct out_s *
+parse_out ( const char *s )
+{
+	int n;
+
+	if ( ! strcmp( s, "bend" ) )
+		return find_out( OUT_BEND, 0 );
+
+	if ( sscanf( s, "c14:%i", &n ) == 1 && n >= 0 && n < 32 )
+		return find_out( OUT_CC14, n );
+
+	if ( sscanf( s, "c:%i", &n ) == 1 && n >= 0 && n < 128 )
+		return find_out( OUT_CC, n );
+
+	return NULL;
+}
+
+/**
+ * Parse axis name or number /s/. Returns the ABS_* code, or -1.
+ */
+static int
+parse_axis ( const char *s )
+{
+	static const struct { const char *name; int code; } names[] = {
+		{ "x", ABS_X }, { "y", ABS_Y }, { "z", ABS_Z },
+		{ "rx", ABS_RX }, { "ry", ABS_RY }, { "rz", ABS_RZ },
+		{ "throttle", ABS_THROTTLE }, { "rudder", ABS_RUDDER },
+		{ "wheel", ABS_WHEEL }, { "gas", ABS_GAS }, { "brake", ABS_BRAKE },
+		{ "hat0x", ABS_HAT0X }, { "hat0y", ABS_HAT0Y },
+	};
+	char *end;
+	int i;
+
+	for ( i = 0; i < elementsof( names ); i++ )
+		if ( ! strcmp( s, names[i].name ) )
+			return names[i].code;
+
+	i = strtol( s, &end, 0 );
+
+	return *s && ! *end && i >= 0 && i < ABS_CNT ? i : -1;
+}
+
+/**
+ * Parse a button number /s/, ending at /end/. Returns it, or -1.
+ */
+static int
+parse_button ( const char *s, char **end )
+{
+	int b = strtol( s, end, 10 );
+
+	return *end != s && b >= 0 && b < MAX_BUTTONS ? b : -1;
+}
+
+/**
+ * Add axis map /spec/ ([-]axis=out[@b[+b...]])
+ */
+static void
+add_axis_map ( char *spec )
+{
+	struct axis_map_s *m;
+	char *out, *hold;
+
+	if ( naxis_maps == MAX_AXIS_MAPS )
+	{
+		fprintf( stderr, "Too many axis maps (at most %i)!\n", MAX_AXIS_MAPS );
+		exit( 1 );
+	}
+
+	m = &axis_maps[ naxis_maps ];
+	memset( m, 0, sizeof( *m ) );
+
+	if ( ( m->invert = *spec == '-' ) )
+		spec++;
+
+	if ( ! ( out = strchr( spec, '=' ) ) )
+		goto bad;
+
+	*out++ = '\0';
+
+	if ( ( hold = strchr( out, '@' ) ) )
+		*hold++ = '\0';
+
+	if ( ( m->axis = parse_axis( spec ) ) < 0 ||
+		 ! ( m->out = parse_out( out ) ) )
+		goto bad;
+
+	while ( hold )
+	{
+		char *end;
+		int b;
+
+		if ( ( b = parse_button( hold, &end ) ) < 0 ||
+			 ( *end && *end != '+' ) )
+			goto bad;
+
+		m->hold |= 1u << b;
+		hold = *end ? end + 1 : NULL;
+	}
+
+	naxis_maps++;
+	return;
+
+bad:
+	fprintf( stderr, "Invalid axis map!\n" );
+	exit( 1 );
+}
+
+/**
+ * Add button map /spec/ (b=c:n)
+ */
+static void
+add_button_map ( char *spec )
+{
+	struct out_s *o;
+	char *end;
+	int b;
+
+	if ( ( b = parse_button( spec, &end ) ) < 0 || *end != '=' ||
+		 ! ( o = parse_out( end + 1 ) ) || o->type != OUT_CC )
+	{
+		fprintf( stderr, "Invalid button map!\n" );
+		exit( 1 );
+	}
+
+	button_maps[ b ] = o;
+}
+
 /**
  * process commandline arguments
  */
-void
+static void
 get_args ( int argc, char **argv )
 {
-	const char *short_opts = "hp:c:vd:nz";
+	const char *short_opts = "h" DRIVER_OPTS "c:d:a:B:nj:i:";
 	const struct option long_opts[] =
 	{
 		{ "help", no_argument, NULL, 'h' },
-		{ "port", required_argument, NULL, 'p' },
+		DRIVER_LONG_OPTS,
 		{ "channel", required_argument, NULL, 'c' },
-		{ "verbose", no_argument, NULL, 'v' },
 		{ "device", required_argument, NULL, 'd' },
+		{ "axis", required_argument, NULL, 'a' },
+		{ "button", required_argument, NULL, 'B' },
 		{ "no-hold", no_argument, NULL, 'n' },
-		{ "daemon", no_argument, NULL, 'z' },
+		{ "jitter", required_argument, NULL, 'j' },
+		{ "interval", required_argument, NULL, 'i' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -136,9 +427,6 @@ get_args ( int argc, char **argv )
 				usage();
 				exit(0);
 				break;
-			case 'p':
-				sub_name = optarg;
-				break;
 			case 'c':
 				channel = atoi( optarg );
 
@@ -152,157 +440,723 @@ get_args ( int argc, char **argv )
 					exit( 1 );
 				}
 				break;
-			case 'v':
-				verbose = 1;
-				break;
 			case 'd':
 				joydevice = optarg;
 				break;
+			case 'a':
+				add_axis_map( optarg );
+				break;
+			case 'B':
+				add_button_map( optarg );
+				break;
 			case 'n':
 				nohold = 1;
 				break;
-			case 'z':
-				daemonize = 1;
+			case 'j':
+				jitter = atoi( optarg );
+				break;
+			case 'i':
+				interval = atoi( optarg );
+				break;
+			default:
+				driver_option( &joystick_driver, c, optarg );
 				break;
 		}
 
 	}
+
+	if ( ! naxis_maps )
+	{
+		/* the two button flight stick this was written for */
+		char spec[][16] = { "-y=bend@0", "-y=c14:1@1", "-x=c14:1@0+1" };
+		int i;
+
+		for ( i = 0; i < elementsof( spec ); i++ )
+			add_axis_map( spec[i] );
+	}
 }
 
-/** main 
- *
+/**
+ * Send /value/ to output /o/ now, and note when. The coarse controller of a
+ * 14 bit pair is left out if it hasn't changed, but the fine one always
+ * follows, as receivers may reset it on a coarse change.
  */
-int
-main ( int argc, char **argv )
+static void
+emit ( struct out_s *o, int value, long long now )
 {
-	fprintf( stderr, "lsmi-joystick" " v" VERSION "\n" );
+	if ( o->type != OUT_CC14 )
+		send_value( &o->ev[0], value );
+	else
+	{
+		if ( o->last == UNSENT || value >> 7 != o->last >> 7 )
+			send_value( &o->ev[0], value >> 7 );
 
-	get_args( argc, argv );
+		send_value( &o->ev[1], value & 0x7F );
+	}
 
-	fprintf( stderr, "Registering MIDI port...\n" );
+	o->last = value;
+	o->pending = UNSENT;
+	o->sent = now;
+}
+
+/**
+ * Return CLOCK_MONOTONIC in uS
+ */
+static long long
+now_us ( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Make sure the coalescing timer goes off by the time /o/'s pending value is
+ * due
+ */
+static void
+arm_timer ( struct out_s *o )
+{
+	struct itimerspec it;
+	long long due = o->sent + interval;
 
-	seq = open_client( CLIENT_NAME );
+	if ( armed && armed <= due )
+		return;
 
-	if ( NULL == seq )
+	memset( &it, 0, sizeof( it ) );
+
+	it.it_value.tv_sec = due / 1000000;
+	it.it_value.tv_nsec = ( due % 1000000 ) * 1000;
+
+	timerfd_settime( tfd, TFD_TIMER_ABSTIME, &it, NULL );
+
+	armed = due;
+}
+
+/**
+ * Set output /o/ to /value/, unless that's what we last sent. A change is
+ * sent right away if the output has been idle for the interval; otherwise it
+ * waits for the interval to be up, replacing any change already waiting.
+ */
+static void
+axis_send ( struct out_s *o, int value )
+{
+	long long now;
+
+	if ( value == o->last )
 	{
-		fprintf( stderr, "Error opening alsa sequencer!\n" );
-		exit( 1 );
+		/* back where it was, so nothing to send after all */
+		o->pending = UNSENT;
+		return;
 	}
 
-	if ( ( port = open_output_port( seq ) ) < 0 )
+	now = now_us();
+
+	if ( now - o->sent >= interval )
+		emit( o, value, now );
+	else
 	{
-		fprintf( stderr, "Error opening MIDI output port!\n" );
-		exit( 1 );
+		o->pending = value;
+		o->stamp = in_stamp;
+		o->clock = in_clock;
+		arm_timer( o );
 	}
+}
+
+/**
+ * The interval is up for some output with a change waiting
+ */
+static void
+coalesce_timer ( int fd, void *arg )
+{
+	uint64_t expirations;
+	long long now;
+	int i;
 
-	if ( sub_name )
+	if ( read( tfd, &expirations, sizeof( expirations ) ) != sizeof( expirations ) )
+		return;
+
+	armed = 0;
+	now = now_us();
+
+	for ( i = 0; i < nouts; i++ )
 	{
-		snd_seq_addr_t addr;
+		if ( outs[i].pending == UNSENT )
+			continue;
 
-		if ( snd_seq_parse_address( seq, &addr, sub_name ) < 0 )
-			fprintf( stderr, "Couldn't parse address '%s'", sub_name );
-		else
-		if ( snd_seq_connect_to( seq, port, addr.client, addr.port ) < 0 )
+		if ( now - outs[i].sent >= interval )
 		{
-			fprintf( stderr, "Error creating subscription for port %i:%i", addr.client, addr.port );
-			exit( 1 );
+			/* aged from the input it came from, not the last one */
+			lat_stamp( &outs[i].stamp, outs[i].clock );
+			emit( &outs[i], outs[i].pending, now );
 		}
+		else
+			arm_timer( &outs[i] );
 	}
 
-	if ( daemonize )
+	flush_events();
+}
+
+/**
+ * Scale the position of axis /a/ to the range of output /o/. The quotients
+ * are exact, truncated toward zero, so a handful of positions come out one
+ * lower than the float scaling this replaced, which rounded up products just
+ * short of a step.
+ */
+static int
+scale ( struct axis_s *a, int invert, struct out_s *o )
+{
+	long long span = a->max - a->min;
+	long long pos = a->raw - a->min;
+
+	if ( span <= 0 )
+		return 0;
+
+	if ( invert )
+		pos = span - pos;
+
+	switch ( o->type )
 	{
-		printf( "Running as daemon...\n" );
-		if ( fork() )
-			exit( 0 );
-		else
+		case OUT_BEND:
+			return ( 2 * pos - span ) * 8191 / span;
+		case OUT_CC:
+			return pos * 127 / span;
+		default:
+			return pos * 16383 / span;
+	}
+}
+
+/**
+ * Whether a map onto /o/ that needs button /b/ is live with /buttons/ held
+ * (any map when /b/ is -1)
+ */
+static int
+drives ( struct out_s *o, int b, unsigned int buttons )
+{
+	int i;
+
+	for ( i = 0; i < naxis_maps; i++ )
+		if ( axis_maps[i].out == o &&
+			 ( b < 0 || axis_maps[i].hold & ( 1u << b ) ) &&
+			 ( axis_maps[i].hold & buttons ) == axis_maps[i].hold )
+			return 1;
+
+	return 0;
+}
+
+/**
+ * Button /b/ went /value/
+ */
+static void
+handle_button ( int b, int value )
+{
+	unsigned int was = held;
+	int i;
+
+	if ( b < 0 || b >= MAX_BUTTONS )
+		return;
+
+	if ( value )
+		held |= 1u << b;
+	else
+	{
+		held &= ~( 1u << b );
+
+		/* let go of what it was holding that nothing still held drives,
+		 * with or without -n */
+		for ( i = 0; i < nouts; i++ )
+			if ( outs[i].last != UNSENT &&
+				 drives( &outs[i], b, was ) &&
+				 ! drives( &outs[i], -1, held ) )
+				axis_send( &outs[i], 0 );
+	}
+
+	if ( button_maps[ b ] )
+		emit( button_maps[ b ], value ? 127 : 0, now_us() );
+}
+
+/**
+ * Axis /code/ moved to /value/
+ */
+static void
+handle_axis ( int code, int value )
+{
+	struct axis_s *a = &axes[ code ];
+	int threshold = (long long)jitter * ( a->max - a->min ) / 65534;
+
+	/* ignore the stick's jitter, but not its limits */
+	if ( abs( value - a->raw ) < threshold &&
+		 value > a->min && value < a->max )
+		return;
+
+	a->raw = value;
+	a->changed = 1;
+}
+
+/**
+ * Send whatever the axes changed since last time call for
+ */
+static void
+send_axes ( void )
+{
+	int i, j;
+
+	for ( i = 0; i < naxis_maps; i++ )
+	{
+		struct axis_map_s *m = &axis_maps[i];
+
+		if ( ! axes[ m->axis ].changed )
+			continue;
+
+		/* the first map of the axis with all its buttons held */
+		for ( j = 0; j < i; j++ )
+			if ( axis_maps[j].axis == m->axis &&
+				 ( nohold || ( held & axis_maps[j].hold ) == axis_maps[j].hold ) )
+				break;
+
+		if ( j < i ||
+			 ! ( nohold || ( held & m->hold ) == m->hold ) )
+			continue;
+
+		axis_send( m->out, scale( &axes[ m->axis ], m->invert, m->out ) );
+	}
+
+	for ( i = 0; i < ABS_CNT; i++ )
+		axes[i].changed = 0;
+}
+
+/**
+ * The kernel dropped events: bring the buttons and axes into line with the
+ * joystick
+ */
+static void
+resync ( void )
+{
+	uint8_t keys[ KEY_MAX / 8 + 1 ];
+	struct input_absinfo ai;
+	int i;
+
+	input_keys( &input, keys, sizeof( keys ) );
+
+	for ( i = 0; i < KEY_CNT; i++ )
+		if ( buttons[i] >= 0 && buttons[i] < MAX_BUTTONS &&
+			 ! testbit( i, keys ) != ! ( held & ( 1u << buttons[i] ) ) )
+			handle_button( buttons[i], ! ! testbit( i, keys ) );
+
+	for ( i = 0; i < naxis_maps; i++ )
+		if ( ioctl( jfd, EVIOCGABS( axis_maps[i].axis ), &ai ) == 0 )
+			handle_axis( axis_maps[i].axis, ai.value );
+
+	send_axes();
+	flush_events();
+}
+
+/**
+ * Handle a frame from the event device
+ */
+static void
+joystick_frame ( struct input_event *frame, int n )
+{
+	int i;
+
+	in_stamp = frame[n - 1].time;
+	in_clock = input.clock;
+
+	for ( i = 0; i < n; i++ )
+		switch ( frame[i].type )
 		{
-			fclose( stdout );
-			fclose( stderr );
+			case EV_KEY:
+				if ( frame[i].code < KEY_CNT && frame[i].value != 2 )
+					handle_button( buttons[ frame[i].code ], frame[i].value );
+				break;
+			case EV_ABS:
+				if ( frame[i].code < ABS_CNT )
+					handle_axis( frame[i].code, frame[i].value );
+				break;
 		}
-	}
 
-	fprintf( stderr, "Initializing joystick...\n" );
+	send_axes();
+}
 
-	if ( -1 == ( jfd = open( joydevice, O_RDONLY ) ) )
+/**
+ * An input device came: if it's the js device we lost, take it back. Returns
+ * -1 to be asked again, if the node isn't ready for us yet, or HOTPLUG_UNSURE
+ * if its link isn't there to tell yet.
+ */
+static int
+js_hotplug ( const char *node, int added, void *arg )
+{
+	uint8_t map[ ABS_CNT ];
+
+	if ( ! added || jfd >= 0 )
+		return 0;
+
+	if ( ! hotplug_match( joydevice, node ) )
+		/* its link may be on its way */
+		return hotplug_unresolved( joydevice ) ? HOTPLUG_UNSURE : 0;
+
+	if ( -1 == ( jfd = open( node, O_RDONLY ) ) )
+		/* udev may not have given it to us yet */
+		return errno == ENOENT || errno == EACCES || errno == EPERM ? -1 : 0;
+
+	if ( ioctl( jfd, JSIOCGAXMAP, map ) == 0 )
+		memcpy( js_axes, map, sizeof( js_axes ) );
+
+	watch_fd( jfd, js_input, NULL );
+
+	driver_back( &joystick_driver, node );
+
+	return 0;
+}
+
+/**
+ * Reading the js device failed with /err/ (0 for EOF): the end of a replay,
+ * or the device gone until it comes back
+ */
+static void
+js_error ( int err )
+{
+	if ( joystick_driver.opts.replay_file )
 	{
-		fprintf( stderr, "Error opening event interface! (%s)\n", strerror( errno ) );
-		clean_up();
-		exit(1);
+		replay_end( joystick_driver.replay );
+		if ( err )
+			fprintf( stderr, "Error reading replay! (%s)\n", strerror( err ) );
+		stop_driver( &joystick_driver );
+		return;
 	}
 
-	set_traps();
+	unwatch_fd( jfd );
+	close( jfd );
+	jfd = -1;
+
+	driver_lost( &joystick_driver, joydevice, err );
+
+	if ( js_watch < 0 && -1 == ( js_watch = hotplug_watch( js_hotplug, NULL ) ) )
+		fprintf( stderr, "Can't watch for %s to come back!\n", joydevice );
+}
 
-	fprintf( stderr, "Waiting for events...\n" );
+/**
+ * Handle whatever events the js device has ready, as one frame
+ */
+static void
+js_input ( int fd, void *arg )
+{
+	struct js_event e[ JS_BATCH ];
+	struct timespec ts;
+	struct timeval tv;
+	int i, n;
 
-	for ( ;; )
+	if ( ( n = read( jfd, e, sizeof( e ) ) ) <= 0 )
 	{
-		struct js_event e;
-		snd_seq_event_t ev;
-		static int b1;
-		static int b2;
+		if ( n == 0 || ( errno != EINTR && errno != EAGAIN ) )
+			js_error( n ? errno : 0 );
+		return;
+	}
+
+	n /= sizeof( struct js_event );
 
-		read (jfd, &e, sizeof(struct js_event));
+	if ( record )
+		record_js( record, e, n );
 
-		snd_seq_ev_clear( &ev );
+	events_read += n;
 
-		switch (e.type)
+	/* js_event.time is in jiffies-derived mS on no clock we can read, so
+	 * latency is measured from here instead */
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	tv.tv_sec = ts.tv_sec;
+	tv.tv_usec = ts.tv_nsec / 1000;
+	lat_stamp( &tv, CLOCK_MONOTONIC );
+
+	in_stamp = tv;
+	in_clock = CLOCK_MONOTONIC;
+
+	/* the synthetic events describing the initial state are left out. There
+	 * are no frames, so axis changes are taken as one, up to a button
+	 * changing what they're mapped to. */
+	for ( i = 0; i < n; i++ )
+		switch ( e[i].type )
 		{
 			case JS_EVENT_BUTTON:
-				switch (e.number)
-				{
-					case 0:
-						if(e.value)
-							b1 = 1;
-						else
-						{
-							b1 = 0;
-							snd_seq_ev_set_pitchbend( &ev, channel, 0 );
-
-							send_event( &ev );
-						}
-						break;
-					case 1:
-						if (e.value)
-							b2 = 1;
-						else
-						{
-							b2 = 0;
-							snd_seq_ev_set_controller( &ev, channel, 1, 0 );
-							send_event( &ev );
-							snd_seq_ev_set_controller( &ev, channel, 33, 0 );
-							send_event( &ev );
-						}
-						break;
-				}
+				send_axes();
+				handle_button( e[i].number, e[i].value );
 				break;
 			case JS_EVENT_AXIS:
-				
-				if ( e.number == 1 && ( b1 || nohold ) )
-				{
-					snd_seq_ev_set_pitchbend( &ev, channel, 0 - (int)((e.value) * ((float)8191/32767) ));
-
-					send_event( &ev );
-				}
-				else
-				if ( ( e.number == 1 && b2 ) ||
-					 ( e.number == 0 && ( ( b1 && b2 ) || nohold ) )
-				)
-				{
-					int fine = (int)((0 - e.value) + 32767) * ((float)16383/65534);
-					int	course = fine >> 7;
-					fine &= 0x7F;
-
-					snd_seq_ev_set_controller( &ev, channel, 1, course );
-					send_event( &ev );
-					snd_seq_ev_set_controller( &ev, channel, 33, fine );
-					send_event( &ev );
-				}
+				handle_axis( js_axes[ e[i].number ], e[i].value );
 				break;
+		}
 
-			 default:
-				break;
+	send_axes();
+	flush_events();
+}
+
+/**
+ * Find the event device belonging to js device /device/ (through sysfs).
+ * Returns its path, or NULL.
+ */
+static char *
+js_to_evdev ( const char *device )
+{
+	const char *name = strrchr( device, '/' );
+	char path[ 64 ];
+	struct dirent *de;
+	DIR *dir;
+
+	snprintf( path, sizeof( path ), "/sys/class/input/%.32s/device",
+			  name ? name + 1 : device );
+
+	if ( ! ( dir = opendir( path ) ) )
+		return NULL;
+
+	while ( ( de = readdir( dir ) ) )
+		if ( ! strncmp( de->d_name, "event", 5 ) )
+		{
+			snprintf( evdevice, sizeof( evdevice ), "/dev/input/%.32s", de->d_name );
+			closedir( dir );
+			return evdevice;
 		}
 
+	closedir( dir );
+
+	return NULL;
+}
+
+/**
+ * Number the buttons the event device has the way joydev would: joystick
+ * and gamepad buttons first, then whatever else.
+ */
+static void
+number_buttons ( int fd )
+{
+	uint8_t keys[ KEY_MAX / 8 + 1 ];
+	int i, n = 0;
+
+	memset( keys, 0, sizeof( keys ) );
+	ioctl( fd, EVIOCGBIT( EV_KEY, sizeof( keys ) ), keys );
+
+	/* a device plugged back in may not have the same buttons */
+	memset( buttons, -1, sizeof( buttons ) );
+
+	for ( i = BTN_JOYSTICK; i < KEY_CNT; i++ )
+		if ( testbit( i, keys ) )
+			buttons[i] = n++;
+
+	for ( i = BTN_MISC; i < BTN_JOYSTICK; i++ )
+		if ( testbit( i, keys ) )
+			buttons[i] = n++;
+}
+
+/**
+ * Take the range and position of each axis from the event device
+ */
+static void
+get_axes ( int fd )
+{
+	uint8_t abs[ ABS_MAX / 8 + 1 ];
+	struct input_absinfo ai;
+	int i;
+
+	memset( abs, 0, sizeof( abs ) );
+	ioctl( fd, EVIOCGBIT( EV_ABS, sizeof( abs ) ), abs );
+
+	for ( i = 0; i < ABS_CNT; i++ )
+		if ( testbit( i, abs ) && ioctl( fd, EVIOCGABS( i ), &ai ) == 0 )
+		{
+			axes[i].min = ai.minimum;
+			axes[i].max = ai.maximum;
+			axes[i].raw = ai.value;
+		}
+}
+
+/**
+ * Whether the device open on /fd/ is a joystick: an event device with
+ * absolute axes, or a js device
+ */
+static int
+joystick_probe ( int fd )
+{
+	uint8_t evt[ EV_MAX / 8 + 1 ];
+	int version;
+
+	if ( ioctl( fd, JSIOCGVERSION, &version ) == 0 )
+		return 1;
+
+	memset( evt, 0, sizeof( evt ) );
+	ioctl( fd, EVIOCGBIT( 0, sizeof( evt ) ), evt );
+
+	return testbit( EV_ABS, evt ) && testbit( EV_KEY, evt );
+}
+
+/**
+ * The port is about to be reset: what is waiting to be sent would land
+ * after it, and what was sent no longer stands
+ */
+static void
+joystick_reset ( void )
+{
+	int i;
+
+	for ( i = 0; i < nouts; i++ )
+		outs[i].last = outs[i].pending = UNSENT;
+}
+
+/**
+ * The joystick's event device was (re)attached, on /fd/
+ */
+static void
+joystick_attached ( int fd )
+{
+	jfd = fd;
+
+	/* what was held went with the old device, controllers were reset */
+	held = 0;
+
+	number_buttons( fd );
+	get_axes( fd );
+}
+
+/**
+ * Open the joystick, preferring its event interface
+ */
+static void
+init_joystick ( void )
+{
+	char *device = joydevice;
+	char *ev;
+	int version;
+
+	if ( ( ev = js_to_evdev( joydevice ) ) )
+		device = ev;
+
+	if ( -1 == ( jfd = open( device, O_RDONLY ) ) )
+	{
+		fprintf( stderr, "Error opening event interface! (%s)\n", strerror( errno ) );
+		exit(1);
+	}
+
+	if ( ioctl( jfd, EVIOCGVERSION, &version ) == 0 )
+	{
+		fprintf( stderr, "Using event device %s\n", device );
+
+		/* through the core, to be opened again should it go */
+		close( jfd );
+		jfd = open_driver_input( &joystick_driver, &input, device, 0 );
+
+		number_buttons( jfd );
+		get_axes( jfd );
+	}
+	else
+	{
+		uint8_t map[ ABS_CNT ];
+
+		use_js = 1;
+
+		/* the js interface numbers the axes it has */
+		if ( ioctl( jfd, JSIOCGAXMAP, map ) == 0 )
+			memcpy( js_axes, map, sizeof( js_axes ) );
 	}
 }
 
+/**
+ * Parse arguments, register our port and open the joystick
+ */
+static void
+joystick_init ( int argc, char **argv )
+{
+	struct driver_opts_s *opts = &joystick_driver.opts;
+	int i;
+
+	get_args( argc, argv );
+
+	port = open_driver_port( &joystick_driver );
+
+	for ( i = 0; i < nouts; i++ )
+	{
+		struct out_s *o = &outs[i];
+
+		if ( o->type == OUT_BEND )
+			event_template( &o->ev[0], port, SND_SEQ_EVENT_PITCHBEND, channel, 0, 0 );
+		else
+			event_template( &o->ev[0], port, SND_SEQ_EVENT_CONTROLLER, channel, o->number, 0 );
+
+		if ( o->type == OUT_CC14 )
+			event_template( &o->ev[1], port, SND_SEQ_EVENT_CONTROLLER, channel, o->number + 32, 0 );
+	}
+
+	fprintf( stderr, "Initializing joystick...\n" );
+
+	/* what a js device reports, until the device says otherwise: its axes
+	 * numbered from ABS_X and its buttons from BTN_JOYSTICK */
+	for ( i = 0; i < ABS_CNT; i++ )
+	{
+		js_axes[i] = i;
+		axes[i].min = -32767;
+		axes[i].max = 32767;
+	}
+
+	memset( buttons, -1, sizeof( buttons ) );
+
+	for ( i = 0; i < MAX_BUTTONS; i++ )
+		buttons[ BTN_JOYSTICK + i ] = i;
+
+	if ( opts->replay_file )
+	{
+		use_js = replay_kind( opts->replay_file ) == REC_JS;
+
+		if ( -1 == ( jfd = replay_open( opts->replay_file, use_js ? REC_JS : REC_EVDEV,
+										opts->replay_repeat, &joystick_driver.replay ) ) )
+			exit( 1 );
+	}
+	else if ( hotplug_spec( joydevice ) )
+	{
+		/* whichever event device matches, whenever it's there */
+		if ( -1 != ( jfd = open_driver_input( &joystick_driver, &input, joydevice, 0 ) ) )
+			joystick_attached( jfd );
+	}
+	else
+		init_joystick();
+
+	/* the js interface has no frames, so it's read here */
+	if ( use_js )
+	{
+		if ( opts->record_file && ! ( record = record_open( opts->record_file, REC_JS ) ) )
+			exit( 1 );
+
+		watch_fd( jfd, js_input, NULL );
+	}
+	else
+	{
+		/* a replay; devices are attached as they're opened */
+		if ( ! joystick_driver.match )
+			attach_input( &joystick_driver, &input, jfd );
+		input.resync = resync;
+	}
+
+	if ( -1 == ( tfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK ) ) )
+	{
+		perror( "timerfd_create()" );
+		exit( 1 );
+	}
+
+	watch_fd( tfd, coalesce_timer, NULL );
+}
+
+struct driver_s joystick_driver = {
+	"joystick", CLIENT_NAME, VERSION,
+	joystick_probe, joystick_init, joystick_frame, NULL, NULL, clean_up, joystick_attached,
+	joystick_reset
+};
+
+#ifdef LSMI_PLUGIN
+struct driver_s *lsmi_driver = &joystick_driver;
+#else
+/** main 
+ *
+ */
+int
+main ( int argc, char **argv )
+{
+	return driver_main( &joystick_driver, argc, argv );
+}
+#endif
@@ -115,11 +115,18 @@
 
 #include "seq.h"
 #include "sig.h"
+#include "input.h"
+#include "loop.h"
+#include "driver.h"
+#include "log.h"
+#include "keydb.h"
 
 #define elementsof(x) ( sizeof( (x) ) / sizeof( (x)[0] ) )
 #define min(x,min) ( (x) < (min) ? (min) : (x) )
 #define max(x,max) ( (x) > (max) ? (max) : (x) )
 #define testbit(bit, array)    (array[bit/8] & (1<<(bit%8)))
+#define setbit(bit, array)    (array[bit/8] |= (1<<(bit%8)))
+#define clearbit(bit, array)    (array[bit/8] &= ~(1<<(bit%8)))
 
 #define CLIENT_NAME "Pseudo-MIDI Keyboard Hack"
 #define VERSION "0.6"
@@ -127,35 +134,38 @@
 #define UP 0
 
 enum prog_modes { PATCH, BANK, CHANNEL };
-enum prog_modes prog_mode = PATCH;
+static enum prog_modes prog_mode = PATCH;
 
 #define NUM_PROG_MODES 3
 
-char *mode_names[] = { "CHANNEL", "PATCH", "BANK" };
+static char *mode_names[] = { "CHANNEL", "PATCH", "BANK" };
 
-char defaultdatabase[] = ".keydb";
-char *database = defaultdatabase;
+static char defaultdatabase[] = ".keydb";
+static char *database = defaultdatabase;
 
-int verbose = 0;
-int prog_index = 0;
+static int prog_index = 0;
 static char prog_buf[4];
-int channel = 0;
+static int channel = 0;
 
-int octave = 5;
-int octave_min = 0;
-int octave_max = 9;
+static int octave = 5;
+static int octave_min = 0;
+static int octave_max = 9;
 
 
-int fd;
+static int fd;
+static struct input_s input;
 
-snd_seq_t *seq = NULL;
-int port;
-struct timeval timeout;
 
-char *sub_name = NULL;								/* subscriber */
+extern struct driver_s keyhack_driver;
 
-char defaultdevice[] = "/dev/input/event0";
-char *device = defaultdevice;
+static int patch = 0;
+static int bank = 0;
+
+static int port;
+static struct timeval timeout;
+
+static char defaultdevice[] = "/dev/input/event0";
+static char *device = defaultdevice;
 
 enum control_keys
 {
@@ -177,12 +187,34 @@ struct map_s {
 	int number;							/* note or controller # */
 };
 
-struct map_s map[KEY_MAX];
+
+/* a key's mapping compiled for the current octave and channel, ready to send */
+struct dispatch_s {
+	unsigned char control;				/* control key, or 0 */
+	unsigned char ev_type;				/* SND_SEQ_EVENT_NOTE, _CONTROLLER, or 0 for nothing */
+	snd_seq_event_t ev[2];				/* to send on UP and DOWN */
+};
+
+/* everything taken from the key database, built aside and flipped in whole
+ * when it changes */
+struct keymap_s {
+	struct map_s map[KEY_MAX];
+	struct dispatch_s dispatch[KEY_MAX];
+	unsigned short mapped[KEY_MAX];		/* codes of the mapped keys */
+	int nmapped;
+};
+
+static struct keymap_s keymaps[2];
+static struct keymap_s *km = &keymaps[0];	/* the one in use */
+
+static int dbwatch = -1;					/* on the database, for reload */
+
+static uint8_t down[ KEY_MAX / 8 + 1 ];		/* keys we've acted on as down */
 
 #define CKEY_MIN CKEY_EXIT
 #define CKEY_MAX CKEY_PATCH_UP
 
-char *key_names[] = {
+static char *key_names[] = {
 	"",
 	"EXIT",
 	"MODE",
@@ -195,74 +227,89 @@ char *key_names[] = {
 	"NUMERIC",
 };
 
-int
-open_database ( char *filename )
+/**
+ * Load the key map from /filename/ into /k/. Returns -1 if it's missing or
+ * invalid.
+ */
+static int
+open_database ( char *filename, struct keymap_s *k )
 {
-	int dbfd;
-
-	if ( -1 == ( dbfd = open( filename, O_RDONLY ) ) )
-		return -1;
-	
-	read( dbfd, map, sizeof ( map ) );
+	struct keydb_s db;
+	int i;
 
-	close( dbfd );
+	switch ( keydb_load( &db, filename, KEYDB_KEYHACK ) )
+	{
+		case 0:
+			break;
+		case -2:
+			/* from before the database had a format of its own */
+			if ( keydb_load_raw( filename, k->map, sizeof( k->map ) ) == 0 )
+			{
+				fprintf( stderr, "Converting old key database (it will be saved in the new format on EXIT)\n" );
+				return 0;
+			}
+			/* fall through */
+		default:
+			return -1;
+	}
 
-	return 0;
-}
+	for ( i = 0; i < db.count; i++ )
+	{
+		const struct keydb_entry_s *e = &db.entries[i];
 
-int
-close_database ( char *filename )
-{
-	int dbfd;
+		if ( e->code >= KEY_MAX )
+			continue;
 
-	if ( -1 == ( dbfd = creat( filename, 0666 ) ) )	
-		return -1;
-	
-	write( dbfd, map, sizeof ( map ) );
+		k->map[ e->code ].control = e->control;
+		k->map[ e->code ].ev_type = e->ev_type;
+		k->map[ e->code ].number = e->number;
+	}
 
-	close( dbfd );
+	keydb_unload( &db );
 
 	return 0;
 }
 
 /**
- * Prepare to die gracefully
+ * Save the mapped keys to /filename/
  */
-void
-clean_up( void )
+static int
+close_database ( char *filename )
 {
-	/* release the keyboard */
-	ioctl( fd, EVIOCGRAB, 0 );
+	static struct keydb_entry_s entries[ KEY_MAX ];
+	int i, n = 0;
 
-	close( fd );
+	for ( i = 0; i < KEY_MAX; i++ )
+	{
+		if ( ! km->map[i].control && ! km->map[i].ev_type )
+			continue;
 
-	snd_seq_close( seq );
-}
+		memset( &entries[n], 0, sizeof( entries[n] ) );
 
-/** 
- * Signal handler
- */
-void
-die( int x )
-{
-  printf( "caught signal %d, cleaning up...\n", x );
-  clean_up();
-  exit( 1 );
+		entries[n].code = i;
+		entries[n].control = km->map[i].control;
+		entries[n].ev_type = km->map[i].ev_type;
+		entries[n].number = km->map[i].number;
+
+		n++;
+	}
+
+	return keydb_save( filename, KEYDB_KEYHACK, entries, n );
 }
 
 /** 
  * print help
  */
-void
+static void
 usage ( void )
 {
 	fprintf( stderr, "Usage: lsmi-keyhack [options]\n"
 	"Options:\n\n"
 		" -h | --help                   Show this message\n"
-		" -d | --device specialfile     Event device to use (instead of event0)\n"
-		" -v | --verbose                Be verbose (show note events)\n"
+		" -d | --device specialfile     Event device to use (instead of event0), or one to wait\n"
+		"                               for: name=pattern, id=vendor:product or phys=pattern\n"
 		" -c | --channel n              Initial MIDI channel\n"
-		" -p | --port client:port       Connect to ALSA Sequencer client on startup\n"					
+		DRIVER_USAGE
 		" -k | --keydata file			Name file to read/write key mappings (instead of ~/.keydb)\n"
 	"\n" );
 }
@@ -270,18 +317,17 @@ usage ( void )
 /** 
  * process commandline arguments
  */
-void
+static void
 get_args ( int argc, char **argv )
 {
-	const char *short_opts = "hp:c:d:k:v";
+	const char *short_opts = "h" DRIVER_OPTS "c:d:k:";
 	const struct option long_opts[] =
 	{
 		{ "help", no_argument, NULL, 'h' },
-		{ "port", required_argument, NULL, 'p' },
+		DRIVER_LONG_OPTS,
 		{ "channel", required_argument, NULL, 'c' },
 		{ "device", required_argument, NULL, 'd' },
 		{ "keydata", required_argument, NULL, 'k' },
-		{ "verbose", no_argument, NULL, 'v' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -293,12 +339,9 @@ get_args ( int argc, char **argv )
 		switch (c)
 		{
 			case 'h':
-				fprintf( stderr, "Help\n" );
+				usage();
 				exit(0);
 				break;
-			case 'p':
-				sub_name = optarg;
-				break;
 			case 'c':
 				channel = atoi( optarg );
 
@@ -317,8 +360,9 @@ get_args ( int argc, char **argv )
 				break;
 			case 'k':
 				database = optarg;
-			case 'v':
-				verbose = 1;
+				break;
+			default:
+				driver_option( &keyhack_driver, c, optarg );
 				break;
 		}
 
@@ -328,24 +372,37 @@ get_args ( int argc, char **argv )
 /** 
  * Block until keypress (down or up) is ready. Return raw key
  */
-int
+static int
 get_keypress ( int *state )
 {
-	struct input_event iev;
-	int keyi;
-	
+	static struct input_event *frame;
+	static int n, i;
+
 	for ( ;; )
 	{
-		read( fd, &iev, sizeof( iev ) );
+		while ( i < n )
+		{
+			struct input_event *iev = &frame[ i++ ];
 
-		if ( iev.type != EV_KEY ||
-			 iev.value == 2 )
-			continue;
-	
-		*state = iev.value == 0 ? UP : DOWN;
-		keyi = iev.code;
+			if ( iev->type != EV_KEY ||
+				 iev->value == 2 )
+				continue;
+
+			*state = iev->value == 0 ? UP : DOWN;
 
-		return keyi;
+			return iev->code;
+		}
+
+		i = 0;
+		n = input_read_frame( &input, &frame );
+
+		/* nothing to wait for it to come back to */
+		if ( n == 0 || ( n < 0 && errno != EINTR ) )
+		{
+			fprintf( stderr, "Lost the keyboard while learning! (%s)\n",
+					 n ? strerror( errno ) : "end of file" );
+			exit( 1 );
+		}
 	}
 }
 
@@ -353,7 +410,7 @@ get_keypress ( int *state )
  * Get complete key (press and release), ignoring other releases. Return key
  * index
  */
-int
+static int
 get_key( void )
 {
 	int key;
@@ -373,7 +430,7 @@ get_key( void )
 /**
  * Prompt for learning given control key
  */
-void
+static void
 learn_key( int control )
 {
 	int keyi;
@@ -382,38 +439,81 @@ learn_key( int control )
 
 	keyi = get_key();
 
-	map[keyi].control = control;
+	km->map[keyi].control = control;
 }
 
 
 /**
- * Analyze in-memory key map to determine number of keys and Middle C offset.
+ * Analyze in-memory key map to determine number of keys and Middle C offset,
+ * and list the mapped keys for compile_map().
  */
-void
-analyze_map ( int *keys, int *mc_offset )
+static void
+analyze_map ( struct keymap_s *k, int *keys, int *mc_offset )
 {
 	int i;
 
 	*keys = 0;
 	*mc_offset = 0;
 
-	for ( i = 0; i < elementsof( map ); i++ )
+	k->nmapped = 0;
+
+	for ( i = 0; i < KEY_MAX; i++ )
 	{
-		if ( map[i].ev_type == SND_SEQ_EVENT_NOTE )
+		if ( k->map[i].control || k->map[i].ev_type )
+			k->mapped[ k->nmapped++ ] = i;
+
+		if ( k->map[i].ev_type == SND_SEQ_EVENT_NOTE )
 		{
 			(*keys)++;
-			if ( map[i].number < *mc_offset )
-				*mc_offset = map[i].number;
+			if ( k->map[i].number < *mc_offset )
+				*mc_offset = k->map[i].number;
 		}
 	}
 
 	*mc_offset = 0 - *mc_offset;
 }
 
+/**
+ * Compile the mapped keys into the dispatch table, for the current octave and
+ * channel. Notes transposed out of MIDI's range are left silent.
+ */
+static void
+compile_map ( struct keymap_s *k )
+{
+	int i;
+
+	for ( i = 0; i < k->nmapped; i++ )
+	{
+		struct map_s *m = &k->map[ k->mapped[i] ];
+		struct dispatch_s *d = &k->dispatch[ k->mapped[i] ];
+		int note = m->number + ( 12 * octave );
+
+		d->control = m->control;
+		d->ev_type = 0;
+
+		switch ( m->ev_type )
+		{
+			case SND_SEQ_EVENT_NOTE:
+				if ( note < 0 || note > 127 )
+					break;
+
+				event_template( &d->ev[ DOWN ], port, SND_SEQ_EVENT_NOTEON, channel, note, 64 );
+				event_template( &d->ev[ UP ], port, SND_SEQ_EVENT_NOTEOFF, channel, note, 64 );
+				d->ev_type = m->ev_type;
+				break;
+			case SND_SEQ_EVENT_CONTROLLER:
+				event_template( &d->ev[ DOWN ], port, SND_SEQ_EVENT_CONTROLLER, channel, m->number, 127 );
+				event_template( &d->ev[ UP ], port, SND_SEQ_EVENT_CONTROLLER, channel, m->number, 0 );
+				d->ev_type = m->ev_type;
+				break;
+		}
+	}
+}
+
 /**
  * set LEDs to indicate program mode
  */
-void
+static void
 update_leds( void )
 {
 	struct input_event iev;
@@ -435,35 +535,26 @@ update_leds( void )
 }
 
 /** 
- * Initialize event and uinput keyboard interfaces */
-void
-init_keyboard ( void )
+ * Whether the event device open on /fd/ is a keyboard
+ */
+static int
+keyhack_probe ( int fd )
 {
   	uint8_t evt[EV_MAX / 8 + 1];
 
+	memset( evt, 0, sizeof( evt ) );
+
 	/* get capabilities */
 	ioctl( fd, EVIOCGBIT( 0, sizeof(evt)), evt );
 
-	if ( ! ( testbit( EV_KEY, evt ) &&
-			 testbit( EV_MSC, evt ) ) )
-	{
-		fprintf( stderr, "'%s' doesn't seem to be a keyboard! look in /proc/bus/input/devices to find the name of your keyboard's event device\n", device );
-		exit( 1 );
-	}
-
-	/* exclusive access */
-	if ( ioctl( fd, EVIOCGRAB, 1 ) )
-	{
-		perror( "EVIOCGRAB" );
-		exit(1);
-	}
+	return testbit( EV_KEY, evt ) && testbit( EV_MSC, evt );
 }
 
 
 /** 
  * Prompt for learning input. Build key database.
  */
-void
+static void
 learn_mode ( void )
 {
 	int keyi;
@@ -476,7 +567,7 @@ learn_mode ( void )
 
 	keyi = get_key();
 
-	map[keyi].control = CKEY_EXIT;
+	km->map[keyi].control = CKEY_EXIT;
 
 	printf( "Press each piano key in succession, beginning with the left-most. When you run out of keys, press the first one again.\n" );
 	
@@ -497,9 +588,9 @@ learn_mode ( void )
 		if ( ! learn_firstkey )
 			learn_firstkey = keyi;
 		
-		map[keyi].control = 0;
-		map[keyi].ev_type = SND_SEQ_EVENT_NOTE;
-		map[keyi].number  = learn_note++;
+		km->map[keyi].control = 0;
+		km->map[keyi].ev_type = SND_SEQ_EVENT_NOTE;
+		km->map[keyi].number  = learn_note++;
 
 		learn_keys++;
 	}
@@ -508,31 +599,31 @@ learn_mode ( void )
 
 	keyi = get_key();
 
-	key_offset =  map[keyi].number;
+	key_offset =  km->map[keyi].number;
 
-	for ( i = 0; i < elementsof( map ); i++ )
+	for ( i = 0; i < KEY_MAX; i++ )
 	{
-		if ( map[i].ev_type == SND_SEQ_EVENT_NOTE )
-			map[i].number -= key_offset;
+		if ( km->map[i].ev_type == SND_SEQ_EVENT_NOTE )
+			km->map[i].number -= key_offset;
 	}
 
-	if ( map[keyi].number + ( 12 * octave ) != 60 )
+	if ( km->map[keyi].number + ( 12 * octave ) != 60 )
 	{
-		fprintf( stderr, "Error in key logic! ( middle C == %i )\n", map[keyi].number + (12 * octave ) );
+		fprintf( stderr, "Error in key logic! ( middle C == %i )\n", km->map[keyi].number + (12 * octave ) );
 	}
 
 	printf( "Basic configuration complete. Press EXIT if you'd like to stop learning now, or any other key if you'd like to continue and configure the auxilliary input methods.\n" );
 
 	keyi = get_key();
 
-	if ( map[keyi].control == CKEY_EXIT )
+	if ( km->map[keyi].control == CKEY_EXIT )
 		return;
 
 	printf( "If your device has 18 key control pad, and you would like to program it now, press any key. To skip this step (and move on to pedals/footswitches), press EXIT.\n");
 
 	keyi = get_key();
 
-	if ( map[keyi].control != CKEY_EXIT )
+	if ( km->map[keyi].control != CKEY_EXIT )
 	{
 		printf( "Press buttons 0 through 9 in ascending numerical order.\n" );
 		
@@ -543,8 +634,8 @@ learn_mode ( void )
 			printf( "%i encoded. ", i );
 			fflush(stdout);
 
-			map[keyi].control = CKEY_NUMERIC;
-			map[keyi].number  = i;
+			km->map[keyi].control = CKEY_NUMERIC;
+			km->map[keyi].number  = i;
 		}
 
 		for ( i = CKEY_MIN + 1; i <= CKEY_MAX; i++ )
@@ -555,305 +646,410 @@ learn_mode ( void )
 
 	keyi = get_key();
 
-	map[keyi].ev_type = SND_SEQ_EVENT_CONTROLLER;
-	map[keyi].number = 64;
+	km->map[keyi].ev_type = SND_SEQ_EVENT_CONTROLLER;
+	km->map[keyi].number = 64;
 
 	printf( "Press and release the Portamento Pedal.\n" );
 
 	keyi = get_key();
 
-	map[keyi].ev_type = SND_SEQ_EVENT_CONTROLLER;
-	map[keyi].number = 65;
+	km->map[keyi].ev_type = SND_SEQ_EVENT_CONTROLLER;
+	km->map[keyi].number = 65;
 
 	printf( "Press and release the Soft Pedal.\n" );
 
 	keyi = get_key();
 
-	map[keyi].ev_type = SND_SEQ_EVENT_CONTROLLER;
-	map[keyi].number = 67;
+	km->map[keyi].ev_type = SND_SEQ_EVENT_CONTROLLER;
+	km->map[keyi].number = 67;
 
 	printf( "\nLearning Complete!\n" );
 }
 
 
-/** main 
- *
+/**
+ * Act on a key going up or down
  */
-int
-main ( int argc, char **argv )
+static void
+handle_key ( int keyi, int newstate )
 {
-	int keys = 0;
-	int mc_offset = 0;
-	
+	struct dispatch_s *d;
 	snd_seq_event_t ev;
 
-	int patch = 0;
-	int bank = 0;
+	if ( keyi >= KEY_MAX )
+		return;
 
-	fprintf( stderr, "lsmi-keyhack" " v" VERSION "\n" );
+	d = &km->dispatch[ keyi ];
 
-	get_args( argc, argv );
+	if ( d->control )
+	{
+		int old_octave = octave;
+		int old_channel = channel;
+		snd_seq_event_t e;
 
-	fprintf( stderr, "Registering MIDI port...\n" );
+		if ( newstate == UP )
+			return;
 
-	seq = open_client( CLIENT_NAME );
+		snd_seq_ev_clear( &ev );
+		snd_seq_ev_clear( &e );
 
-	if ( NULL == seq )
-	{
-		fprintf( stderr, "Error opening alsa sequencer!\n" );
-		exit( 1 );
-	}
+		switch ( km->map[keyi].control )
+		{	
+			/* All notes off */
+			snd_seq_ev_set_controller( &ev, channel, 123, 0 );
+			send_event( port, &ev );
+			snd_seq_ev_clear( &ev );
 
-	if ( ( port = open_output_port( seq ) ) < 0 )
-	{
-		fprintf( stderr, "Error opening MIDI output port!\n" );
-		exit( 1 );
-	}
+			case CKEY_EXIT:
+				fprintf( stderr, "Exiting...\n" );
 
-	if ( sub_name )
-	{
-		snd_seq_addr_t addr;
+				if ( close_database( database ) < 0 )
+					fprintf( stderr, "Error saving database!\n" );
 
-		if ( snd_seq_parse_address( seq, &addr, sub_name ) < 0 )
-			fprintf( stderr, "Couldn't parse address '%s'", sub_name );
-		else
-		if ( snd_seq_connect_to( seq, port, addr.client, addr.port ) < 0 )
-		{
-			fprintf( stderr, "Error creating subscription for port %i:%i", addr.client, addr.port );
-			exit( 1 );
-		}
-	}
+				stop_driver( &keyhack_driver );
 
-	fprintf( stderr, "Initializing keyboard...\n" );
+				return;
 
-	if ( -1 == ( fd = open( device, O_RDWR ) ) )
-	{
-		fprintf( stderr, "Error opening event interface! (%s)\n", strerror( errno ) );
-		exit(1);
-	}
+			case CKEY_MODE:
 
-	init_keyboard();
+				prog_mode = prog_mode + 1 > NUM_PROG_MODES - 1 ? 0 : prog_mode + 1;
+				log_str( stderr, "Input mode change to %s\n", mode_names[prog_mode] );
+			
+				update_leds();
 
-	set_traps();
+				break;
 
-	update_leds();
+			case CKEY_OCTAVE_DOWN:
+				octave = min( octave - 1, octave_min );
+				break;
+			case CKEY_OCTAVE_UP:
+				octave = max( octave + 1, octave_max );
+				break;
+			case CKEY_CHANNEL_DOWN:
+				channel = min( channel - 1, 0 );
+				break;
+			case CKEY_CHANNEL_UP:
+				channel = max( channel + 1, 15 );
+				break;
+			case CKEY_PATCH_DOWN:
+				if ( patch == 0 && bank > 0 )
+				{
+					bank = min( bank - 1, 0 );
+					patch = 127;
 
-	fprintf( stderr, "Opening database...\n" );
+					snd_seq_ev_set_controller( &e, channel, 0, bank );
+					send_event( port, &e );
+				}
+				else
+					patch = min( patch - 1, 0 );
 
-	if ( database == defaultdatabase )
-	{
-		char *home = getenv( "HOME" );
+				snd_seq_ev_set_pgmchange( &ev, channel, patch );
+				break;
+			case CKEY_PATCH_UP:
+				if ( patch == 127 && bank < 127 )
+				{
+					bank = max( bank + 1, 127 );
+					patch = 0;
 
-		database = malloc( strlen( home ) + strlen( defaultdatabase ) + 2 );
+					snd_seq_ev_set_controller( &e, channel, 0, bank );
+					send_event( port, &e );
+				}
+				else
+					patch = max( patch + 1, 127 );
 
-		sprintf( database, "%s/%s", home, defaultdatabase );
-	}
+				snd_seq_ev_set_pgmchange( &ev, channel, patch );
+				break;
 
-	if ( -1 == open_database( database ) )
-	{
-		fprintf( stderr, "******Key database missing or invalid******\n"
-						 "Entering learning mode...\n"
-						 "Make sure your \"keyboard\" device is connected!\n" );
+			case CKEY_NUMERIC:
+				{
+					struct timeval tv;
 
-		learn_mode();
-	}
+					gettimeofday( &tv, NULL );
+					/* Timeout in 5 secs */
 
-	analyze_map( &keys, &mc_offset );
+					if ( tv.tv_sec - timeout.tv_sec >= 5 )
+					{
+						prog_index = 0;
+					}
 
-	octave_min = (mc_offset / 12) + 1;
-	octave_max = 9 - ( ( keys - mc_offset ) / 12 );
+					timeout = tv;
 
-	fprintf( stderr, "%i keys, middle C is %ith from the left, lowest MIDI octave == %i, highest, %i\n", keys, mc_offset + 1, octave_min, octave_max );
+					if ( prog_index == 0 )
+						log_str( stdout, "INPUT %s #: ", mode_names[ prog_mode ] );
+				}
 
-	fprintf( stderr, "Waiting for events...\n" );
+				prog_buf[ prog_index++ ] = 48 + km->map[keyi].number;
+				log_msg( stdout, "%i", km->map[keyi].number, 0 );
 
-	for ( ;; )
-	{	
-		int keyi, newstate;
+				if ( prog_index == 2 && prog_mode == CHANNEL )
+				{
 
-		keyi = get_keypress( &newstate );
-		
-		snd_seq_ev_clear( &ev );
+					/* FIXME: all notes off->channel */
 
-		if ( map[keyi].control )
-		{
-			snd_seq_event_t e;
+					prog_buf[++prog_index] = '\0';
+					channel = atoi( prog_buf );
+					
+					channel = max( channel, 15 );
 
-			if ( newstate == UP )
-				continue;
+					prog_index = 0;
 
-			switch ( map[keyi].control )
-			{	
-				/* All notes off */
-				snd_seq_ev_set_controller( &ev, channel, 123, 0 );
-				send_event( &ev );
-				snd_seq_ev_clear( &ev );
+					log_msg( stdout, " ENTER\n", 0, 0 );
+				}
+				else
+				if ( prog_index == 3 )
+				{
+					prog_buf[++prog_index] = '\0';
 
-				case CKEY_EXIT:
-					fprintf( stderr, "Exiting...\n" );
+					switch ( prog_mode )
+					{
+						case PATCH:
+							patch = atoi( prog_buf );
 
-					if ( close_database( database ) < 0 )
-						fprintf( stderr, "Error saving database!\n" );
+							patch = max( patch, 127 );
 
-					clean_up();
+							snd_seq_ev_set_pgmchange( &ev, channel, patch );
 
-					exit(0);
+							break;
+						case BANK:
+							bank = atoi( prog_buf );
+							
+							bank = max ( bank, 127 );
 
-				case CKEY_MODE:
+							snd_seq_ev_set_controller( &ev, channel, 0, bank );
+							break;
+						default:
+							log_msg( stderr, "Internal error!\n", 0, 0 );
+					}
 
-					prog_mode = prog_mode + 1 > NUM_PROG_MODES - 1 ? 0 : prog_mode + 1;
-					fprintf( stderr, "Input mode change to %s\n", mode_names[prog_mode] );
-				
-					update_leds();
+					prog_index = 0;
+					log_msg( stdout, " ENTER\n", 0, 0 );
+				}
 
-					break;
+				break;
+			default:
+				log_msg( stderr, "Internal error!\n", 0, 0 );
+		}
 
-				case CKEY_OCTAVE_DOWN:
-					octave = min( octave - 1, octave_min );
-					break;
-				case CKEY_OCTAVE_UP:
-					octave = max( octave + 1, octave_max );
-					break;
-				case CKEY_CHANNEL_DOWN:
-					channel = min( channel - 1, 0 );
-					break;
-				case CKEY_CHANNEL_UP:
-					channel = max( channel + 1, 15 );
-					break;
-				case CKEY_PATCH_DOWN:
-					if ( patch == 0 && bank > 0 )
-					{
-						bank = min( bank - 1, 0 );
-						patch = 127;
+		if ( octave != old_octave || channel != old_channel )
+			compile_map( km );
 
-						snd_seq_ev_set_controller( &e, channel, 0, bank );
-						send_event( &e );
-					}
-					else
-						patch = min( patch - 1, 0 );
+		send_event( port, &ev );
 
-					snd_seq_ev_set_pgmchange( &ev, channel, patch );
-					break;
-				case CKEY_PATCH_UP:
-					if ( patch == 127 && bank < 127 )
-					{
-						bank = max( bank + 1, 127 );
-						patch = 0;
+		return;
+	}
+	
+	/* unmapped, or transposed out of range */
+	if ( ! d->ev_type )
+		return;
 
-						snd_seq_ev_set_controller( &e, channel, 0, bank );
-						send_event( &e );
-					}
-					else
-						patch = max( patch + 1, 127 );
+	send_template( &d->ev[ newstate ] );
+}
 
-					snd_seq_ev_set_pgmchange( &ev, channel, patch );
-					break;
+/**
+ * Act on key /keyi/ going /newstate/, unless it's already there
+ */
+static void
+key_event ( int keyi, int newstate )
+{
+	if ( keyi >= KEY_MAX || ! testbit( keyi, down ) == ( newstate == UP ) )
+		return;
 
-				case CKEY_NUMERIC:
-					{
-						struct timeval tv;
+	if ( newstate == DOWN )
+		setbit( keyi, down );
+	else
+		clearbit( keyi, down );
 
-						gettimeofday( &tv, NULL );
-						/* Timeout in 5 secs */
+	handle_key( keyi, newstate );
+}
 
-						if ( tv.tv_sec - timeout.tv_sec >= 5 )
-						{
-							prog_index = 0;
-						}
+/**
+ * The kernel dropped events: bring the mapped keys into line with the
+ * keyboard, sounding and releasing notes and controllers as need be. Control
+ * keys pressed meanwhile are too late to act on.
+ */
+static void
+resync_keys ( void )
+{
+	uint8_t keys[ KEY_MAX / 8 + 1 ];
+	int i;
 
-						timeout = tv;
+	input_keys( &input, keys, sizeof( keys ) );
 
-						if ( prog_index == 0 )
-							printf( "INPUT %s #: ", mode_names[ prog_mode ] );
-					}
+	for ( i = 0; i < km->nmapped; i++ )
+	{
+		int k = km->mapped[i];
 
-					prog_buf[ prog_index++ ] = 48 + map[keyi].number;
-					printf( "%i", map[keyi].number );
-					fflush(stdout);
+		if ( ! testbit( k, keys ) == ! testbit( k, down ) )
+			continue;
 
-					if ( prog_index == 2 && prog_mode == CHANNEL )
-					{
+		if ( km->dispatch[k].control && testbit( k, keys ) )
+			setbit( k, down );
+		else
+			key_event( k, testbit( k, keys ) ? DOWN : UP );
+	}
 
-						/* FIXME: all notes off->channel */
+	flush_events();
+}
 
-						prog_buf[++prog_index] = '\0';
-						channel = atoi( prog_buf );
-						
-						channel = max( channel, 15 );
+/**
+ * Handle a frame from the keyboard
+ */
+static void
+keyhack_frame ( struct input_event *frame, int n )
+{
+	int i;
 
-						prog_index = 0;
+	for ( i = 0; i < n; i++ )
+		if ( frame[i].type == EV_KEY &&
+			 frame[i].value != 2 )
+			key_event( frame[i].code, frame[i].value == 0 ? UP : DOWN );
+}
 
-						printf( " ENTER\n" );
-					}
-					else
-					if ( prog_index == 3 )
-					{
-						prog_buf[++prog_index] = '\0';
+/**
+ * List /k/'s keys and set the octaves they can be shifted through
+ */
+static void
+range_map ( struct keymap_s *k )
+{
+	int keys, mc_offset;
 
-						switch ( prog_mode )
-						{
-							case PATCH:
-								patch = atoi( prog_buf );
+	analyze_map( k, &keys, &mc_offset );
 
-								patch = max( patch, 127 );
+	octave_min = (mc_offset / 12) + 1;
+	octave_max = 9 - ( ( keys - mc_offset ) / 12 );
 
-								snd_seq_ev_set_pgmchange( &ev, channel, patch );
+	fprintf( stderr, "%i keys, middle C is %ith from the left, lowest MIDI octave == %i, highest, %i\n", keys, mc_offset + 1, octave_min, octave_max );
+}
 
-								break;
-							case BANK:
-								bank = atoi( prog_buf );
-								
-								bank = max ( bank, 127 );
+/**
+ * The key database changed on disk: build the new map aside and flip to it,
+ * between frames. Keys held across the change are released under the old
+ * map, and their coming up ignored, so nothing is left sounding.
+ */
+static void
+reload_database ( const char *name, void *arg )
+{
+	struct keymap_s *k = &keymaps[ km == keymaps ];
+	int i;
 
-								snd_seq_ev_set_controller( &ev, channel, 0, bank );
-								break;
-							default:
-								fprintf( stderr, "Internal error!\n" );
-						}
+	memset( k, 0, sizeof( *k ) );
 
-						prog_index = 0;
-						printf( " ENTER\n" );
-					}
+	if ( -1 == open_database( database, k ) )
+	{
+		fprintf( stderr, "Key database '%s' is invalid, keeping the old one\n", database );
+		return;
+	}
 
-					break;
-				default:
-					fprintf( stderr, "Internal error!\n" );
-			}
+	range_map( k );
 
-			send_event( &ev );
+	octave = max( min( octave, octave_min ), octave_max );
 
-			continue;
-		}
-		else		
-		switch ( map[keyi].ev_type )
-		{
-			case SND_SEQ_EVENT_CONTROLLER:
+	compile_map( k );
 
-				snd_seq_ev_set_controller( &ev, channel,
-											    map[keyi].number,
-											    newstate == DOWN ? 127 : 0 );
+	for ( i = 0; i < km->nmapped; i++ )
+	{
+		int c = km->mapped[i];
 
-				break;
+		if ( testbit( c, down ) && km->dispatch[c].ev_type )
+			send_template( &km->dispatch[c].ev[ UP ] );
+	}
 
-			case SND_SEQ_EVENT_NOTE:
-			
-				if ( newstate == DOWN )
-					snd_seq_ev_set_noteon( &ev,	channel,
-										   map[keyi].number + ( 12 * octave ),
-							64 );
-				else
-					snd_seq_ev_set_noteoff( &ev, channel,
-										   map[keyi].number + ( 12 * octave ),
-							64 );
-				break;
+	memset( down, 0, sizeof( down ) );
 
-			default:
-				fprintf( stderr,
-						 "Key has invalid mapping!\n" );
-				break;
+	km = k;
+
+	flush_events();
+
+	fprintf( stderr, "Reloaded key database '%s'\n", database );
+}
+
+/**
+ * Stop watching the database
+ */
+static void
+clean_up ( void )
+{
+	unwatch_file( dbwatch );
+}
+
+/**
+ * The keyboard was plugged back in, on /kfd/
+ */
+static void
+keyhack_attached ( int kfd )
+{
+	fd = kfd;
+
+	update_leds();
+}
+
+/**
+ * Parse arguments, register our port, open the keyboard and load (or learn) the
+ * key database
+ */
+static void
+keyhack_init ( int argc, char **argv )
+{
+	get_args( argc, argv );
+
+	port = open_driver_port( &keyhack_driver );
+
+	fprintf( stderr, "Initializing keyboard...\n" );
+
+	fd = open_driver_input( &keyhack_driver, &input, device, INPUT_WRITE | INPUT_GRAB );
+
+	update_leds();
+
+	fprintf( stderr, "Opening database...\n" );
+
+	if ( database == defaultdatabase )
+	{
+		char *home = getenv( "HOME" );
+
+		database = malloc( strlen( home ) + strlen( defaultdatabase ) + 2 );
+
+		sprintf( database, "%s/%s", home, defaultdatabase );
+	}
+
+	if ( -1 == open_database( database, km ) )
+	{
+		if ( fd < 0 )
+		{
+			fprintf( stderr, "Key database missing or invalid, and no keyboard to learn from!\n" );
+			exit( 1 );
 		}
 
-		send_event( &ev );
+		fprintf( stderr, "******Key database missing or invalid******\n"
+						 "Entering learning mode...\n"
+						 "Make sure your \"keyboard\" device is connected!\n" );
+
+		learn_mode();
 	}
+
+	range_map( km );
+	compile_map( km );
+
+	/* pick up changes to the database as they're saved */
+	if ( -1 == ( dbwatch = watch_file( database, reload_database, NULL ) ) )
+		fprintf( stderr, "Can't watch key database, changes will need a restart\n" );
+
+	input.resync = resync_keys;
 }
 
+struct driver_s keyhack_driver = {
+	"keyhack", CLIENT_NAME, VERSION,
+	keyhack_probe, keyhack_init, keyhack_frame, NULL, NULL, clean_up, keyhack_attached
+};
+
+#ifdef LSMI_PLUGIN
+struct driver_s *lsmi_driver = &keyhack_driver;
+#else
+/** main 
+ *
+ */
+int
+main ( int argc, char **argv )
+{
+	return driver_main( &keyhack_driver, argc, argv );
+}
+#endif
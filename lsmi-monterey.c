@@ -144,6 +144,8 @@
 #include <sys/ioctl.h>
 
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <signal.h>
 #include <getopt.h>
 
 #include <linux/input.h>
@@ -155,12 +157,19 @@
 
 #include "seq.h"
 #include "sig.h"
+#include "input.h"
+#include "loop.h"
+#include "driver.h"
+#include "log.h"
+#include "lat.h"
 
 #define elementsof(x) ( sizeof( (x) ) / sizeof( (x)[0] ) )
 #define min(x,min) ( (x) < (min) ? (min) : (x) )
 #define max(x,max) ( (x) > (max) ? (max) : (x) )
 
 #define testbit(bit, array)    (array[bit/8] & (1<<(bit%8)))
+#define setbit(bit, array)    (array[bit/8] |= (1<<(bit%8)))
+#define clearbit(bit, array)    (array[bit/8] &= ~(1<<(bit%8)))
 
 
 #define STRIP_REPEATS 1
@@ -179,42 +188,66 @@
  * if you experience dropped or stuck notes. The only disadvantage of longer
  * timeouts is that it's easier to trick the driver into generating notes by
  * pressing letter and number keys simultaneously (which, by the way, is nigh
- * impossible to do while typing naturally) */
+ * impossible to do while typing naturally) 
+ *
+ * KEY_TIMEOUT is now only the longest we will wait. Every textual key is held
+ * back for the timeout, so the driver learns the delays of the attached
+ * keyboard and waits just long enough to cover GAP_PERMILLE of them (those
+ * slow bytes included, as long as they're more common than that), plus
+ * GAP_MARGIN. */
 
 #define KEY_TIMEOUT 15000							/* in microseconds */
 
+#define GAP_BUCKET 250								/* uS per histogram bucket */
+#define GAP_BUCKETS ( KEY_TIMEOUT / GAP_BUCKET )
+#define GAP_PERMILLE 995							/* of delays to wait for */
+#define GAP_MARGIN 2000								/* uS on top of that */
+#define GAP_MIN_SAMPLES 32							/* before trusting what we've learned */
+#define GAP_MAX_SAMPLES 1024						/* before forgetting half of it */
+
 /* global options */
-int verbose = 0;
-int no_velocity = 0;
-int daemonize = 0;
+static int no_velocity = 0;
 
 /* MIDI state */
-int channel = 0;
-int patch_page = 0;
-int bank_page = 0;
-int patch = 0;
-int bank = 0;
-int octave = 5; 
+static int channel = 0;
+static int patch_page = 0;
+static int bank_page = 0;
+static int patch = 0;
+static int bank = 0;
+static int octave = 5; 
+
+static const int octave_min = 3;
+static const int octave_max = 7;
+
+static char defaultdevice[] = "/dev/input/event0";
+static char *device = defaultdevice;
+
+static int fd;												/* keyboard fd */
+static int uifd = -1;										/* uinput fd */
+static int tfd = -1;										/* velocity deadline timer */
 
-const int octave_min = 3;
-const int octave_max = 7;
+#define UI_FRAMES 32										/* passthrough frames per write() */
 
-char defaultdevice[] = "/dev/input/event0";
-char *device = defaultdevice;
+static struct input_event uibuf[ UI_FRAMES * 3 ];			/* pending passthrough frames */
+static int uilen = 0;										/* events in uibuf */
+static uint8_t passed[ KEY_MAX / 8 + 1 ];					/* keys down on uinput */
+static uint8_t uikeys[ KEY_MAX / 8 + 1 ];					/* keys uinput was given */
+static uint8_t sounding[ 16 * 128 / 8 ];					/* notes on, by channel */
+static struct input_s input;								/* keyboard events */
 
-int fd;												/* keyboard fd */
-int uifd;											/* uinput fd */
 
-snd_seq_t *seq = NULL;								/* alsa_seq handle */
-int port;											/* our output port */
+extern struct driver_s monterey_driver;
+
+static int port;											/* our output port */
+
+static void upstream_input __P(( int ufd, void *arg ));
 
-char *sub_name = NULL;								/* subscriber */
 
 static int keymap[KEY_MIN_INTERESTING + 1];
 static int nummap[KEY_MINUS + 1];
 
 /* valid key designators, in order */
-const int keylist[] = {
+static const int keylist[] = {
 	  KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J,
 	  KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T,
 	  KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z, KEY_8, KEY_9, KEY_MINUS,
@@ -223,16 +256,18 @@ const int keylist[] = {
 };
 
 /* valid velocity values, in order */
-const int numlist[] =
+static const int numlist[] =
 {
   KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7,
 };
 
-char notemap[38] = "-------------------------------------";
+#if 0
+static char notemap[38] = "-------------------------------------";
+#endif
 
 /** 
  * Initialize key and velocity key mappings */
-void
+static void
 init_maps ( void )
 {
 	int i;
@@ -255,7 +290,7 @@ init_maps ( void )
 /** 
  * Is /x/ a valid velocity byte?
  */
-int
+static int
 isnum( int x )
 {
 	if ( x >= elementsof( nummap ) )
@@ -267,7 +302,7 @@ isnum( int x )
 /** 
  * Is /x/ a valid key byte?
  */
-int
+static int
 iskey( int x )
 {
 	if ( x >= elementsof( keymap ) )
@@ -278,33 +313,39 @@ iskey( int x )
 
 
 
-/** 
- * Get ready to die gracefully.
+/**
+ * Unregister the uinput keyboard, if there is one, forgetting what was
+ * passed through to it
  */
-void
-clean_up ( void )
+static void
+close_uinput ( void )
 {
-	/* release the keyboard */
-	ioctl( fd, EVIOCGRAB, 0 );
+	if ( uifd < 0 )
+		return;
+
+	unwatch_fd( uifd );
 
 	/* unregister with uinput */
 	ioctl( uifd, UI_DEV_DESTROY, 0 );
 
 	close( uifd );
- 	close( fd );
+	uifd = -1;
 
-	snd_seq_close( seq );
+	uilen = 0;
+	memset( passed, 0, sizeof( passed ) );
 }
 
 /** 
- * Signal handler
+ * Get ready to die gracefully.
  */
-void
-die ( int sig )
+static void
+clean_up ( void )
 {
-	printf( "caught signal %d, cleaning up...\n", sig );
-	clean_up();
-	exit( 1 );
+	unwatch_fd( tfd );
+
+	close( tfd );
+
+	close_uinput();
 }
 
 
@@ -313,20 +354,18 @@ die ( int sig )
  * print help
  *
  */
-void
+static void
 usage ( void )
 {
 	fprintf( stderr, "Usage: lsmi-monterey [options]\n"
 	"Options:\n\n"
 		" -h | --help                   Show this message\n"
-		" -d | --device specialfile     Event device to use (instead of event0)\n"
-		" -v | --verbose                Be verbose (show note events)\n"
+		" -d | --device specialfile     Event device to use (instead of event0), or one to wait\n"
+		"                               for: name=pattern, id=vendor:product or phys=pattern\n"
 		" -R | --realtime rtprio        Use realtime priority 'rtprio' (requires privs)\n"
 		" -n | --no-velocity            Ignore velocity information from keyboard\n"
 		" -c | --channel n              Initial MIDI channel\n"
-		" -p | --port client:port       Connect to ALSA Sequencer client on startup\n" );
-	fprintf( stderr, 
-		" -z | --daemon                 Fork and don't print anything to stdout\n"
+		DRIVER_USAGE
 	"\n" );
 }
 
@@ -334,20 +373,18 @@ usage ( void )
 /** 
  * process commandline arguments
  */
-void
+static void
 get_args ( int argc, char **argv )
 {
-	const char *short_opts = "hp:c:vnd:R:z";
+	const char *short_opts = "h" DRIVER_OPTS "c:nd:R:";
 	const struct option long_opts[] =
 	{
 		{ "help", no_argument, NULL, 'h' },
-		{ "port", required_argument, NULL, 'p' },
+		DRIVER_LONG_OPTS,
 		{ "channel", required_argument, NULL, 'c' },
-		{ "verbose", no_argument, NULL, 'v' },
 		{ "no-veloticy", no_argument, NULL, 'n' },
 		{ "device", required_argument, NULL, 'd' },
 		{ "realtime", required_argument, NULL, 'R' },
-		{ "daemon", no_argument, NULL, 'z' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -362,9 +399,6 @@ get_args ( int argc, char **argv )
 				usage();
 				exit(0);
 				break;
-			case 'p':
-				sub_name = optarg;
-				break;
 			case 'c':
 				channel = atoi( optarg );
 
@@ -378,9 +412,6 @@ get_args ( int argc, char **argv )
 					exit( 1 );
 				}
 
-				break;
-			case 'v':
-				verbose = 1;
 				break;
 			case 'd':
 				device = optarg;
@@ -405,8 +436,8 @@ get_args ( int argc, char **argv )
 						sp.sched_priority );
 				}
 				break;
-			case 'z':
-				daemonize = 1;
+			default:
+				driver_option( &monterey_driver, c, optarg );
 				break;
 		}
 	}
@@ -414,12 +445,12 @@ get_args ( int argc, char **argv )
 
 
 enum prog_modes { MUSIC, PATCH, BANK, CHANNEL };
-enum prog_modes prog_mode = MUSIC;
+static enum prog_modes prog_mode = MUSIC;
 
 /** 
  * Process function key press, returns 0 if /key/ isn't a function key
  */
-int
+static int
 func_key ( int key )
 {
 	switch ( key )
@@ -463,12 +494,12 @@ func_key ( int key )
 			if ( prog_mode == CHANNEL )
 			{
 				channel = min( channel - 1, 0 );
-				printf( "Channel Change: %i\n", channel );
+				log_msg( stdout, "Channel Change: %i\n", channel, 0 );
 			}
 			else
 			{
 				octave = min( octave - 1, octave_min );
-				printf("Octave Change: %i\n", octave );
+				log_msg( stdout, "Octave Change: %i\n", octave, 0 );
 			}
 
 
@@ -478,12 +509,12 @@ func_key ( int key )
 			if ( prog_mode == CHANNEL )
 			{
 				channel = max( channel + 1, 15 );
-				printf("Channel Change: %i\n", channel );
+				log_msg( stdout, "Channel Change: %i\n", channel, 0 );
 			}
 			else
 			{
 				octave = max( octave + 1, octave_max );
-				printf( "Octave Change: %i\n", octave );
+				log_msg( stdout, "Octave Change: %i\n", octave, 0 );
 			}
 
 			break;
@@ -501,24 +532,51 @@ func_key ( int key )
 }
 
 
+/**
+ * Write all pending passthrough frames to uinput at once. Call at the end of
+ * each burst of input.
+ */
+static void
+flush_keys ( void )
+{
+	int i;
+
+	if ( ! uilen )
+		return;
+
+	/* no uinput device when replaying */
+	if ( uifd >= 0 &&
+		 write( uifd, uibuf, uilen * sizeof( uibuf[0] ) ) < 0 )
+		log_msg( stderr, "Error writing to uinput! (errno %i)\n", errno, 0 );
+
+	for ( i = uilen / 3; i--; )
+		lat_record( LAT_UINPUT );
+
+	uilen = 0;
+}
+
 /** 
- * Pass input event pointed to by /ev/ to uinput
+ * Queue input event pointed to by /ev/ for uinput, as a complete frame
  */
-void
+static void
 send_key( struct input_event *ev )
 {
 #ifndef STRIP_REPEATS
 	static int prev_key;
 #endif
 
-	struct input_event sc;
+	struct input_event *sc;
 
-	sc.type = EV_MSC;
-	sc.code = MSC_SCAN;
-	sc.value = ev->code;
-	sc.time = ev->time;
+	if ( uilen + 3 > elementsof( uibuf ) )
+		flush_keys();
 
-	write( uifd, &sc, sizeof ( sc ) );
+	sc = &uibuf[ uilen ];
+	uilen += 3;
+
+	sc[0].type = EV_MSC;
+	sc[0].code = MSC_SCAN;
+	sc[0].value = ev->code;
+	sc[0].time = ev->time;
 
 #ifndef STRIP_REPEATS
 	if ( ev->value != 0 )
@@ -532,47 +590,65 @@ send_key( struct input_event *ev )
 	/* X is broken for repeats, eat fudge */
 	ev->value = ev->value == 2 ? 1 : ev->value;
 #endif
-		
-	write( uifd, ev, sizeof ( sc ) );
 
-	sc.type = EV_SYN;
-	sc.code = SYN_REPORT;
-	sc.value = 0;
+	if ( ev->code < KEY_MAX )
+	{
+		if ( ev->value )
+			setbit( ev->code, passed );
+		else
+			clearbit( ev->code, passed );
+	}
+
+	sc[1] = *ev;
 
-	write( uifd, &sc, sizeof ( sc ) );
+	sc[2].type = EV_SYN;
+	sc[2].code = SYN_REPORT;
+	sc[2].value = 0;
+	sc[2].time = ev->time;
 }
 
 /** 
- * Initialize event and uinput keyboard interfaces
+ * Whether the event device open on /fd/ is a keyboard
  */
-void
-init_keyboard ( void )
+static int
+monterey_probe ( int fd )
 {
-	struct uinput_user_dev uidev;
   	uint8_t evt[EV_MAX / 8 + 1];
-  	uint8_t keys[KEY_MAX / 8 + 1];
-	int i;
+
+	memset( evt, 0, sizeof( evt ) );
 
 	/* get capabilities */
 	ioctl( fd, EVIOCGBIT( 0, sizeof(evt)), evt );
 
-	if ( ! ( testbit( EV_KEY, evt ) &&
-			 testbit( EV_MSC, evt ) ) )
-	{
-		fprintf( stderr, "'%s' doesn't seem to be a keyboard! look in /proc/bus/input/devices to find the name of your keyboard's event device\n", device );
-		exit( 1 );
-	}
+	return testbit( EV_KEY, evt ) && testbit( EV_MSC, evt );
+}
+
+/** 
+ * Create the uinput keyboard the textual side's keys are passed through to,
+ * with the keys of the keyboard open on fd. Called again whenever the
+ * keyboard is attached, the device is only made anew if they've changed.
+ */
+static void
+init_uinput ( void )
+{
+	struct uinput_user_dev uidev;
+  	uint8_t keys[KEY_MAX / 8 + 1];
+	int i;
 
 	/* get keys */
+	memset( keys, 0, sizeof( keys ) );
 	ioctl( fd, EVIOCGBIT( EV_KEY, sizeof(keys)), keys );
 
-	/* exclusive access */
-	if ( ioctl( fd, EVIOCGRAB, 1 ) )
+	if ( uifd >= 0 )
 	{
-		perror( "EVIOCGRAB" );
-		exit(1);
+		if ( ! memcmp( keys, uikeys, sizeof( keys ) ) )
+			return;
+
+		close_uinput();
 	}
 
+	memcpy( uikeys, keys, sizeof( keys ) );
+
 	if ( -1 == ( uifd = open( "/dev/input/uinput", O_RDWR | O_NDELAY ) ) )
 	{
 		fprintf( stderr, "Error opening uinput interface! (is the uinput module loaded?)\n" );
@@ -601,10 +677,12 @@ init_keyboard ( void )
 	write( uifd, &uidev, sizeof( uidev ) );
 
 	ioctl( uifd, UI_DEV_CREATE, 0 );
+
+	watch_fd( uifd, upstream_input, NULL );
 }
 
 #if 0
-double
+static double
 usec_diff ( struct timeval *tv1, struct timeval *tv2 )
 {
 	double d = ( tv2->tv_sec + tv2->tv_usec * 1e-6 ) -
@@ -619,287 +697,515 @@ usec_diff ( struct timeval *tv1, struct timeval *tv2 )
 }
 #endif
 
-/** main 
- *
+#define KEY 0
+#define VELOCITY 1
+
+/* key/velocity pairing state */
+static int expecting = KEY;
+static struct input_event prev_iev;
+static time_t quaver_sec = 0;
+
+/* learned key to velocity delays */
+static unsigned int gaps[ GAP_BUCKETS ];
+static unsigned int ngaps = 0;
+static int key_timeout = KEY_TIMEOUT;				/* uS */
+static struct timeval timed_out;					/* key we last gave up on */
+
+/**
+ * Return microseconds from /tv1/ to /tv2/
  */
-int
-main ( int argc, char **argv )
+static long
+usec_between ( const struct timeval *tv1, const struct timeval *tv2 )
 {
-	static snd_seq_event_t ev;
-
-	struct input_event iev;
-	struct input_event prev_iev;
+	return ( tv2->tv_sec - tv1->tv_sec ) * 1000000L + ( tv2->tv_usec - tv1->tv_usec );
+}
 
-	#define KEY 0
-	#define VELOCITY 1
+/**
+ * Learn from a velocity byte stamped /vel/ following a key stamped /key/, and
+ * adjust the timeout to suit
+ */
+static void
+learn_gap ( const struct timeval *key, const struct timeval *vel )
+{
+	long us = usec_between( key, vel );
+	unsigned int i, n;
+	int t;
 
-	int expecting = KEY;
-	int key, value, scancode = -1;
+	if ( us < 0 || us >= KEY_TIMEOUT )
+		return;
 
-	time_t quaver_sec = 0;
+	gaps[ us / GAP_BUCKET ]++;
 
-	fprintf( stderr, "\nlsmi-monterey" " v" VERSION "\n" );
+	if ( ++ngaps >= GAP_MAX_SAMPLES )
+	{
+		/* follow changes in the keyboard (or the machine's load) */
+		for ( ngaps = i = 0; i < GAP_BUCKETS; i++ )
+			ngaps += gaps[i] /= 2;
+	}
 
-	get_args( argc, argv );
+	if ( ngaps < GAP_MIN_SAMPLES )
+		return;
 
-	init_maps();
+	for ( n = i = 0; i < GAP_BUCKETS - 1; i++ )
+		if ( ( n += gaps[i] ) * 1000 >= ngaps * GAP_PERMILLE )
+			break;
 
-	fprintf( stderr, "Registering MIDI port...\n" );
+	t = max( ( i + 1 ) * GAP_BUCKET + GAP_MARGIN, KEY_TIMEOUT );
 
-	if ( ( seq = open_client( CLIENT_NAME ) ) == NULL )
+	if ( t != key_timeout )
 	{
-		fprintf( stderr, "Error opening alsa sequencer!\n" );
-		exit( 1 );
-	}
+		key_timeout = t;
 
-	if ( ( port = open_output_port( seq ) ) < 0 )
-	{
-		fprintf( stderr, "Error opening MIDI output port!\n" );
-		exit( 1 );
+		if ( verbose )
+			log_msg( stdout, "Velocity timeout now %iuS\n", key_timeout, 0 );
 	}
-	
-	if ( sub_name )
-	{
-		snd_seq_addr_t addr;
+}
 
-		if ( snd_seq_parse_address( seq, &addr, sub_name ) < 0 )
-			fprintf( stderr, "Couldn't parse address '%s'", sub_name );
-		else
-		if ( snd_seq_connect_to( seq, port, addr.client, addr.port ) < 0 )
+/**
+ * Expect a velocity byte until key_timeout after the key event stamped /tv/.
+ * The deadline is absolute, on the same clock as the event timestamps, so
+ * neither other input nor our own lateness in reading the key moves it. There
+ * is no need to disarm the timer once the velocity arrives, as it is ignored
+ * when not expecting one and rearming discards any pending expiry.
+ */
+static void
+arm_velocity_timer ( const struct timeval *tv )
+{
+	struct itimerspec it;
+
+	memset( &it, 0, sizeof( it ) );
+
+	it.it_value.tv_sec = tv->tv_sec;
+	it.it_value.tv_nsec = ( tv->tv_usec + key_timeout ) * 1000L;
+
+	it.it_value.tv_sec += it.it_value.tv_nsec / 1000000000;
+	it.it_value.tv_nsec %= 1000000000;
+
+	timerfd_settime( tfd, TFD_TIMER_ABSTIME, &it, NULL );
+}
+
+/**
+ * Reduce a complete input frame to a single key event in /iev/, stamped with
+ * the time of the frame's SYN_REPORT. Returns 0 if the frame carries no key.
+ */
+static int
+frame_key ( struct input_event *frame, int n, struct input_event *iev )
+{
+	int key = -1, value = -1, scancode = -1;
+	int i;
+
+	for ( i = 0; i < n; i++ )
+	{
+		switch ( frame[i].type )
 		{
-			fprintf( stderr, "Error creating subscription for port %i:%i", addr.client, addr.port );
-			exit( 1 );
+			case EV_KEY:
+				key = frame[i].code;
+				value = frame[i].value;
+				break;
+			case EV_MSC:
+				if ( frame[i].code == MSC_SCAN )
+					scancode = frame[i].value;
+				break;
 		}
 	}
 
-	fprintf( stderr, "Initializing keyboard...\n" );
-
-	if ( -1 == ( fd = open( device, O_RDWR ) ) )
-	{ 
-		fprintf( stderr, "Error opening event interface! (%s)\n", strerror( errno ) );
-		exit(1);
+	if ( frame[n - 1].type != EV_SYN ||
+		 frame[n - 1].code != SYN_REPORT )
+	{
+		log_msg( stderr, "Unknown event type!\n", 0, 0 );
+		return 0;
 	}
 
-	init_keyboard();
+	*iev = frame[n - 1];
 
-	if ( daemonize )
+	iev->type = EV_KEY;
+
+	if ( key >= 0 )
 	{
-		printf( "Running as daemon...\n" );
-		if ( fork() )
-			exit( 0 );
-		else
-		{
-			fclose( stdout );
-			fclose( stderr );
-		}
+		iev->code = key;
+		iev->value = value;
+	}
+	else
+	{
+		iev->code = scancode;
+		iev->value = 2;
 	}
 
-	set_traps();
+	return 1;
+}
 
-	fprintf( stderr, "Waiting for events...\n" );
+/**
+ * Feed key event /iev/ through the key/velocity state machine
+ */
+static void
+handle_key ( struct input_event *iev )
+{
+	static snd_seq_event_t ev;
 
-	for ( ;; )
-	{	
-		int retval;
-		fd_set rfds;
-		struct timeval tv;
+loop:
 
-		FD_ZERO( &rfds );
-		FD_SET( fd, &rfds );
-		FD_SET( uifd, &rfds );
+	switch ( expecting )
+	{
+		case KEY:
 
-		tv.tv_sec = 0;
-		tv.tv_usec = KEY_TIMEOUT;
+			/* a velocity byte after we gave up on its key: too late for the
+			 * note, but the next timeout will allow for it */
+			if ( timed_out.tv_sec && isnum( iev->code ) )
+				learn_gap( &timed_out, &iev->time );
 
-		retval = select( max( fd, uifd ) + 1, &rfds, NULL, NULL,
-			 expecting != KEY ? &tv : NULL  );
-			 
-		if ( retval == -1 )
-			perror("select()");
-		else
-		if ( retval )
-		{
-			/* Input is waiting */
+			timed_out.tv_sec = 0;
+
+			if ( iskey( iev->code ) )
+			{
+				prev_iev = *iev;
+				expecting = VELOCITY;
+
+				arm_velocity_timer( &iev->time );
+			}
+			else
+			if ( iev->code == KEY_F9 )
+			{
+				quaver_sec = iev->time.tv_sec;
+				prog_mode = MUSIC;
+			}
+			else
+			if ( ( iev->time.tv_sec - quaver_sec )
+					<= FUNCTION_TIMEOUT )
+			{
+				if ( func_key( iev->code ) )
+					quaver_sec = iev->time.tv_sec;
+				else
+					/* can't be a piano key, pass it */
+					send_key( iev );
+			}
+			else
+				/* can't be a piano key, pass it */
+				send_key( iev );
 
-			/* Handle upstream input (LED, REP) */
-			if ( FD_ISSET( uifd, &rfds ) )
+		
+			break;
+		case VELOCITY:
+
+			expecting = KEY;
+
+			/* past the deadline, even if read along with its key before the
+			 * timer could fire: as if it had, the key was a textual one */
+			if ( usec_between( &prev_iev.time, &iev->time ) >= key_timeout )
 			{
-				fprintf( stderr, "Sending event upstream..\n" );
-				read( uifd, &iev, sizeof( iev ) );
-				write( fd, &iev, sizeof ( iev ) );
+				timed_out = prev_iev.time;
+
+				send_key( &prev_iev );
+
+				goto loop;
 			}
 
-			/* Handle keyboard input */
-			if ( FD_ISSET( fd, &rfds ) )
+			if ( iskey( iev->code ) )
+			{
+				send_key( &prev_iev );
+
+				goto loop;
+			}
+			else
+			if ( isnum( iev->code ) )
 			{
-				read( fd, &iev, sizeof( iev ) );
+				learn_gap( &prev_iev.time, &iev->time );
+
+				snd_seq_ev_clear( &ev );
+
 
-				switch ( iev.type )
+				switch ( prog_mode )
 				{
-					case EV_KEY:
-						key = iev.code;
-						value = iev.value;
-						continue;
-						break;
-					case EV_MSC:
-						if ( iev.code == MSC_SCAN )
-							scancode = iev.value;
-						continue;
+
+					case PATCH:
+						patch = max( keymap[ prev_iev.code ], 31 ) +
+							( 32 * patch_page );
+
+
+						snd_seq_ev_set_pgmchange( &ev, channel, patch );
+						prog_mode = MUSIC;
 						break;
-					case EV_SYN:
-						if ( iev.code != SYN_REPORT )
-						{
-							fprintf( stderr, "Unknown event type!\n" );
-							continue;
-						}
+					case BANK:
+						bank = max( keymap[ prev_iev.code ], 31 ) +
+							( 32 * bank_page );
+
+						snd_seq_ev_set_controller( &ev, channel, 0, bank );
+						prog_mode = MUSIC;
 						break;
+
 					default:
-						continue;
-				}
+					{
 
-				iev.type = EV_KEY;
-							
-				if ( key >= 0 )
-				{
-					iev.code = key;
-					iev.value = value;
-				}
-				else
-				{
-					iev.code = scancode;
-					iev.value = 2;
-				}
+						/* This MUST be a piano key! */
+						int note = ( keymap[ prev_iev.code ] - 19 ) + ( 12 * octave );
+						int velocity = nummap[ iev->code ];
 
-				scancode = value = key = -1;
 
-		loop:
+#if 0
+						notemap[ keymap[ prev_iev.code ] ] = velocity == 0 ? '-' : '0' + velocity;
 
-				switch ( expecting )
-				{
-					case KEY:
+						notemap[37] = '\0';
 
-						if ( iskey( iev.code ) )
-						{
-							prev_iev = iev;
-							expecting = VELOCITY;
-						}
-						else
-						if ( iev.code == KEY_F9 )
-						{
-							quaver_sec = iev.time.tv_sec;
-							prog_mode = MUSIC;
-						}
-						else
-						if ( ( iev.time.tv_sec - quaver_sec )
-								<= FUNCTION_TIMEOUT )
+						printf( "\r[%s]", notemap );
+						fflush( stdout );
+#endif
+
+						/* 0 = off, 7 = softest, 1 = hardest (insane, I know) */
+						velocity = ! velocity ? 0 : 127 / velocity;
+						
+						if ( no_velocity )
+							velocity = 64;
+
+						/* when scheduling, time the note from the key, not from
+						 * the velocity that trails it by a varying gap */
+						if ( monterey_driver.opts.latency >= 0 )
+							lat_stamp( &prev_iev.time, input.clock );
+
+						/* finally, generate a noteon */
+						snd_seq_ev_set_noteon( &ev, channel, note, velocity );
+
+						if ( note >= 0 && note < 128 )
 						{
-							if ( func_key( iev.code ) )
-								quaver_sec = iev.time.tv_sec;
+							if ( velocity )
+								setbit( channel * 128 + note, sounding );
 							else
-								/* can't be a piano key, pass it */
-								send_key( &iev );
+								clearbit( channel * 128 + note, sounding );
 						}
-						else
-							/* can't be a piano key, pass it */
-							send_key( &iev );
-
-					
 						break;
-					case VELOCITY:
+					}
 
-						expecting = KEY;
+				}
 
-						if ( iskey( iev.code ) )
-						{
-							send_key( &prev_iev );
+				send_event( port, &ev );
 
-							goto loop;
-						}
-						else
-						if ( isnum( iev.code ) )
-						{
-							snd_seq_ev_clear( &ev );
-		
+				prev_iev = *iev;
+				expecting = KEY;
+			}
+			else
+			{
+				send_key( &prev_iev );
 
-							switch ( prog_mode )
-							{
+				goto loop;
+			}
+			
+			break;
+	}
+}
 
-								case PATCH:
-									patch = max( keymap[ prev_iev.code ], 31 ) +
-										( 32 * patch_page );
+/**
+ * The kernel dropped events. A key waiting for its velocity byte may have
+ * lost it (or be a lost key's velocity byte), so it's forgotten. The musical
+ * side sends no releases, so there's no state to read back for it: every note
+ * still sounding is released rather than risk one sticking. Textual keys
+ * passed through that are no longer down are released too.
+ */
+static void
+resync_keys ( void )
+{
+	uint8_t keys[ KEY_MAX / 8 + 1 ];
+	struct input_event iev;
+	snd_seq_event_t ev;
+	int i;
 
+	expecting = KEY;
+	timed_out.tv_sec = 0;
 
-									snd_seq_ev_set_pgmchange( &ev, channel, patch );
-									prog_mode = MUSIC;
-									break;
-								case BANK:
-									bank = max( keymap[ prev_iev.code ], 31 ) +
-										( 32 * bank_page );
+	for ( i = 0; i < 16 * 128; i++ )
+		if ( testbit( i, sounding ) )
+		{
+			snd_seq_ev_clear( &ev );
+			snd_seq_ev_set_noteoff( &ev, i / 128, i % 128, 0 );
+			send_event( port, &ev );
 
-									snd_seq_ev_set_controller( &ev, channel, 0, bank );
-									prog_mode = MUSIC;
-									break;
+			clearbit( i, sounding );
+		}
 
-								default:
-								{
+	input_keys( &input, keys, sizeof( keys ) );
 
-									/* This MUST be a piano key! */
-									int note = ( keymap[ prev_iev.code ] - 19 ) + ( 12 * octave );
-									int velocity = nummap[ iev.code ];
+	memset( &iev, 0, sizeof( iev ) );
+	iev.type = EV_KEY;
+	gettimeofday( &iev.time, NULL );
 
+	for ( i = 0; i < KEY_MAX; i++ )
+		if ( testbit( i, passed ) && ! testbit( i, keys ) )
+		{
+			iev.code = i;
+			iev.value = 0;
+			send_key( &iev );
+		}
 
-#if 0
-									notemap[ keymap[ prev_iev.code ] ] = velocity == 0 ? '-' : '0' + velocity;
+	flush_events();
+	flush_keys();
+}
 
-									notemap[37] = '\0';
+/**
+ * Handle upstream input (LED, REP)
+ */
+static void
+upstream_input ( int ufd, void *arg )
+{
+	struct input_event iev;
 
-									printf( "\r[%s]", notemap );
-									fflush( stdout );
-#endif
+	log_msg( stderr, "Sending event upstream..\n", 0, 0 );
 
-									/* 0 = off, 7 = softest, 1 = hardest (insane, I know) */
-									velocity = ! velocity ? 0 : 127 / velocity;
-									
-									if ( no_velocity )
-										velocity = 64;
+	if ( read( uifd, &iev, sizeof( iev ) ) != sizeof( iev ) )
+		return;
 
-									/* finally, generate a noteon */
-									snd_seq_ev_set_noteon( &ev, channel, note, velocity );
-									break;
-								}
+	/* not while the keyboard is unplugged */
+	if ( monterey_driver.input )
+		write( fd, &iev, sizeof ( iev ) );
+}
 
-							}
+/**
+ * Handle whatever frames the keyboard has ready
+ */
+static void
+keyboard_input ( int kfd, void *arg )
+{
+	struct input_event iev;
+	struct input_event *frame;
+	int n;
 
-							send_event( &ev );
+	if ( ( n = input_fill( &input ) ) <= 0 )
+	{
+		/* end of replay, or the keyboard gone */
+		if ( n == 0 || ( errno != EINTR && errno != EAGAIN ) )
+			driver_input_error( &monterey_driver, n ? errno : 0 );
+		return;
+	}
 
-							prev_iev = iev;
-							expecting = KEY;
-						}
-						else
-						{
-							send_key( &prev_iev );
+	while ( ( n = input_frame( &input, &frame ) ) )
+	{
+		if ( frame_key( frame, n, &iev ) )
+			handle_key( &iev );
 
-							goto loop;
-						}
-						
-						break;
-				}
+		flush_events();
+	}
 
-			}
+	flush_keys();
+}
 
-		}
-		else
-		{
-			/* select timed out. No input to read */
+/**
+ * The velocity deadline passed. If no velocity byte came in time, the key was
+ * a textual one
+ */
+static void
+velocity_expired ( int fd, void *arg )
+{
+	uint64_t expirations;
 
-			if ( expecting == VELOCITY )
-			{
-				expecting = KEY;
+	/* rearmed since it fired */
+	if ( read( tfd, &expirations, sizeof( expirations ) ) != sizeof( expirations ) )
+		return;
 
-				send_key( &prev_iev );
-			}
+	if ( expecting == VELOCITY )
+	{
+		expecting = KEY;
+
+		timed_out = prev_iev.time;
+
+		/* the key's latency, not the timer's */
+		lat_stamp( &prev_iev.time, input.clock );
+
+		send_key( &prev_iev );
+		flush_keys();
+	}
+}
+
+/**
+ * The port is about to be reset, the keyboard gone or lsmi exiting: let go
+ * of the keys passed through, which uinput would otherwise go on repeating,
+ * and forget the notes and any key still waiting for its velocity byte
+ */
+static void
+monterey_reset ( void )
+{
+	struct input_event iev;
+	int i;
+
+	expecting = KEY;
+	timed_out.tv_sec = 0;
+	memset( sounding, 0, sizeof( sounding ) );
+
+	memset( &iev, 0, sizeof( iev ) );
+	iev.type = EV_KEY;
+	gettimeofday( &iev.time, NULL );
+
+	for ( i = 0; i < KEY_MAX; i++ )
+		if ( testbit( i, passed ) )
+		{
+			iev.code = i;
+			iev.value = 0;
+			send_key( &iev );
 		}
 
+	flush_keys();
+}
+
+/**
+ * The keyboard was plugged back in, on /kfd/
+ */
+static void
+monterey_attached ( int kfd )
+{
+	fd = kfd;
+
+	/* made with the keys of the first keyboard to turn up */
+	init_uinput();
+
+	watch_fd( fd, keyboard_input, NULL );
+}
+
+/**
+ * Parse arguments, register our port and set up the keyboard and its uinput
+ * twin
+ */
+static void
+monterey_init ( int argc, char **argv )
+{
+	get_args( argc, argv );
+
+	init_maps();
+
+	port = open_driver_port( &monterey_driver );
+
+	fprintf( stderr, "Initializing keyboard...\n" );
+
+	/* read here rather than through frame(), to pass the keys on to uinput
+	 * once for all the frames at hand */
+	fd = open_driver_input( &monterey_driver, &input, device, INPUT_WRITE | INPUT_GRAB );
+
+	/* a keyboard still to turn up makes it when it does */
+	if ( ! monterey_driver.opts.replay_file && fd >= 0 )
+		init_uinput();
+
+	if ( -1 == ( tfd = timerfd_create( input.clock, TFD_NONBLOCK ) ) )
+	{
+		perror( "timerfd_create()" );
+		exit( 1 );
 	}
+
+	input.resync = resync_keys;
+
+	if ( fd >= 0 )
+		watch_fd( fd, keyboard_input, NULL );
+	watch_fd( tfd, velocity_expired, NULL );
 }
 
+struct driver_s monterey_driver = {
+	"monterey", CLIENT_NAME, VERSION,
+	monterey_probe, monterey_init, NULL, NULL, NULL, clean_up, monterey_attached,
+	monterey_reset
+};
+
+#ifdef LSMI_PLUGIN
+struct driver_s *lsmi_driver = &monterey_driver;
+#else
+/** main 
+ *
+ */
+int
+main ( int argc, char **argv )
+{
+	return driver_main( &monterey_driver, argc, argv );
+}
+#endif
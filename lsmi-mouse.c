@@ -54,6 +54,7 @@
 #include <linux/input.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <signal.h>
 
 #include <stdint.h>
 
@@ -61,11 +62,16 @@
 
 #include "seq.h"
 #include "sig.h"
+#include "input.h"
+#include "loop.h"
+#include "driver.h"
 
+#define elementsof(x) ( sizeof( (x) ) / sizeof( (x)[0] ) )
 #define min(x,min) ( (x) < (min) ? (min) : (x) )
 #define max(x,max) ( (x) > (max) ? (max) : (x) )
 
 #define testbit(bit, array)    (array[bit/8] & (1<<(bit%8)))
+#define setbit(bit, array)    (array[bit/8] |= (1<<(bit%8)))
 
 
 #define CLIENT_NAME "Pseudo-MIDI Mouse"
@@ -73,35 +79,35 @@
 #define DOWN 1
 #define UP 0
 
-char *sub_name = NULL;
-int verbose = 0;
-int port = 0;
-snd_seq_t *seq = NULL;
+static int port = 0;
 
-int daemonize = 0;
-
-char defaultdevice[] = "/dev/input/event2";
-char *device = defaultdevice;
+static char defaultdevice[] = "/dev/input/event2";
+static char *device = defaultdevice;
 
 /* button mapping */
 struct map_s {
 	int ev_type;
 	unsigned int number;				/* note or controller # */
 	unsigned int channel;
+	snd_seq_event_t ev;					/* ready to send, but for the value */
 };
 
-struct map_s map[3] = {
+static struct map_s map[3] = {
 	{SND_SEQ_EVENT_CONTROLLER, 64, 0},
 	{SND_SEQ_EVENT_NOTEON, 36, 0},
 	{SND_SEQ_EVENT_NOTEON, 37, 0},
 };
 
-int fd;
+static int down[3];									/* as last acted on */
+
+static struct input_s input;
+
+extern struct driver_s mouse_driver;
 
 /**
  * Parse user supplied mapping argument 
  */
-void
+static void
 parse_map ( int i, const char *s )
 {
 	unsigned char t[2];
@@ -136,40 +142,36 @@ parse_map ( int i, const char *s )
  * print help
  *
  */
-void
+static void
 usage ( void )
 {
 	fprintf( stderr, "Usage: lsmi-mouse [options]\n"
 	"Options:\n\n"
 		" -h | --help                   Show this message\n"
-		" -d | --device specialfile     Event device to use (instead of event0)\n"
-		" -v | --verbose                Be verbose (show note events)\n"
-		" -p | --port client:port       Connect to ALSA Sequencer client on startup\n"					
-
+		" -d | --device specialfile     Event device to use (instead of event0), or one to wait\n"
+		"                               for: name=pattern, id=vendor:product or phys=pattern\n"
+		DRIVER_USAGE
 		" -1 | --button-one 'c'|'n':n:n     Button mapping\n"
 		" -2 | --button-two 'c'|'n':n:n     Button mapping\n"
-		" -3 | --button-thrree 'c'|'n':n:n  Button mapping\n" );
-	fprintf( stderr, 	" -z | --daemon                 Fork and don't print anything to stdout\n"
+		" -3 | --button-thrree 'c'|'n':n:n  Button mapping\n"
 	"\n" );
 }
 
 /** 
  * process commandline arguments
  */
-void
+static void
 get_args ( int argc, char **argv )
 {
-	const char *short_opts = "hp:vd:1:2:3:z";
+	const char *short_opts = "h" DRIVER_OPTS "d:1:2:3:";
 	const struct option long_opts[] =
 	{
 		{ "help", no_argument, NULL, 'h' },
-		{ "port", required_argument, NULL, 'p' },
-		{ "verbose", no_argument, NULL, 'v' },
+		DRIVER_LONG_OPTS,
 		{ "device", required_argument, NULL, 'd' },
 		{ "button-one", required_argument, NULL, '1' },
 		{ "button-two", required_argument, NULL, '2' },
 		{ "button-three", required_argument, NULL, '3' },
-		{ "daemon", no_argument, NULL, 'z' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -184,12 +186,6 @@ get_args ( int argc, char **argv )
 				usage();
 				exit(0);
 				break;
-			case 'p':
-				sub_name = optarg;
-				break;
-			case 'v':
-				verbose = 1;
-				break;
 			case 'd':
 				device = optarg;
 				break;
@@ -202,166 +198,161 @@ get_args ( int argc, char **argv )
 			case '3':
 				parse_map( 2, optarg );
 				break;
-			case 'z':
-				daemonize = 1;
+			default:
+				driver_option( &mouse_driver, c, optarg );
 				break;
 		}
 	}
 }
 
 /** 
- * Get ready to die gracefully.
+ * Whether the event device open on /fd/ is a mouse
  */
-void
-clean_up ( void )
+static int
+mouse_probe ( int fd )
 {
-	/* release the mouse */
-	ioctl( fd, EVIOCGRAB, 0 );
+  	uint8_t evt[EV_MAX / 8 + 1];
+
+	memset( evt, 0, sizeof( evt ) );
 
- 	close( fd );
+	/* get capabilities */
+	ioctl( fd, EVIOCGBIT( 0, sizeof(evt)), evt );
 
-	snd_seq_close( seq );
+	return testbit( EV_KEY, evt ) && testbit( EV_REL, evt );
 }
 
+
 /**
- * Signal handler
+ * Have the kernel hold back everything but button events, so motion doesn't
+ * wake us
  */
-void
-die ( int sig )
+static void
+mask_events ( void )
 {
-	printf( "caught signal %d, cleaning up...\n", sig );
-	clean_up();
-	exit( 1 );
-}
+	uint8_t types[ EV_MAX / 8 + 1 ];
+	uint8_t keys[ KEY_MAX / 8 + 1 ];
 
-/** 
- * Initialize event device for mouse. 
- */
-void
-init_mouse ( void )
-{
-  	uint8_t evt[EV_MAX / 8 + 1];
+	memset( types, 0, sizeof( types ) );
+	memset( keys, 0, sizeof( keys ) );
 
-	/* get capabilities */
-	ioctl( fd, EVIOCGBIT( 0, sizeof(evt)), evt );
+	setbit( EV_SYN, types );
+	setbit( EV_KEY, types );
 
-	if ( ! ( testbit( EV_KEY, evt ) &&
-			 testbit( EV_REL, evt ) ) )
-	{
-		fprintf( stderr, "'%s' doesn't seem to be a mouse! look in /proc/bus/input/devices to find the name of your mouse's event device\n", device );
-		exit( 1 );
-	}
+	setbit( BTN_LEFT, keys );
+	setbit( BTN_MIDDLE, keys );
+	setbit( BTN_RIGHT, keys );
 
-	if ( ioctl( fd, EVIOCGRAB, 1 ) )
-	{
-		perror( "EVIOCGRAB" );
-		exit(1);
-	}
+	if ( input_mask( &input, EV_KEY, keys, sizeof( keys ) ) < 0 ||
+		 input_mask( &input, 0, types, sizeof( types ) ) < 0 )
+		fprintf( stderr, "Kernel can't mask events, motion will be ignored instead\n" );
 }
 
-
-/** main 
- *
+/**
+ * Generate the mapped event for a button going up or down, unless it already
+ * had
  */
-int
-main ( int argc, char **argv )
+static void
+handle_button ( int code, int value )
 {
-	snd_seq_event_t ev;
-	struct input_event iev;
-	snd_seq_addr_t addr;
+	int i;
 
-	fprintf( stderr, "lsmi-mouse" " v" VERSION "\n" );
+	switch ( code )
+	{
+		case BTN_LEFT:		i = 0; break;
+		case BTN_MIDDLE:	i = 1; break;
+		case BTN_RIGHT:		i = 2; break;
+		default:
+			return;
+	}
 
-	get_args( argc, argv );
+	if ( down[i] == ( value == DOWN ) )
+		return;
 
-	fprintf( stderr, "Initializing mouse interface...\n" );
+	down[i] = value == DOWN;
 
-	if ( -1 == ( fd = open( device, O_RDONLY ) ) )
-	{
-		fprintf( stderr, "Error opening event interface! (%s)\n", strerror( errno ) );
-		exit(1);
-	}
+	send_value( &map[i].ev, value == DOWN ? 127 : 0 );
+}
 
-	init_mouse();
+/**
+ * The kernel dropped events: bring the buttons into line with the mouse
+ */
+static void
+resync_buttons ( void )
+{
+	static const int codes[] = { BTN_LEFT, BTN_MIDDLE, BTN_RIGHT };
+	uint8_t keys[ KEY_MAX / 8 + 1 ];
+	int i;
 
-	fprintf( stderr, "Registering MIDI port...\n" );
+	input_keys( &input, keys, sizeof( keys ) );
 
-	seq = open_client( CLIENT_NAME  );
-	port = open_output_port( seq );
+	for ( i = 0; i < 3; i++ )
+		handle_button( codes[i], testbit( codes[i], keys ) ? DOWN : UP );
 
-	if ( sub_name )
-	{
-		if ( snd_seq_parse_address( seq, &addr, sub_name ) < 0 )
-			fprintf( stderr, "Couldn't parse address '%s'", sub_name );
-		else
-		if ( snd_seq_connect_to( seq, port, addr.client, addr.port ) < 0 )
-		{
-			fprintf( stderr, "Error creating subscription for port %i:%i", addr.client, addr.port );
-			exit( 1 );
-		}
-	}
-	
-	if ( daemonize )
-	{
-		printf( "Running as daemon...\n" );
-		if ( fork() )
-			exit( 0 );
-		else
-		{
-			fclose( stdout );
-			fclose( stderr );
-		}
-	}
+	flush_events();
+}
 
-	set_traps();
+/**
+ * Handle a frame from the mouse
+ */
+static void
+mouse_frame ( struct input_event *frame, int n )
+{
+	int i;
 
-	fprintf( stderr, "Waiting for packets...\n" );
+	for ( i = 0; i < n; i++ )
+		if ( frame[i].type == EV_KEY )
+			handle_button( frame[i].code, frame[i].value );
+}
 
-	for ( ;; )
-	{
-		int i;
+/**
+ * The mouse was plugged back in
+ */
+static void
+mouse_attached ( int fd )
+{
+	mask_events();
+}
 
-		read( fd, &iev, sizeof( iev ) );
+/**
+ * Parse arguments, open the mouse and register our port
+ */
+static void
+mouse_init ( int argc, char **argv )
+{
+	int i;
 
-		if ( iev.type != EV_KEY )
-			continue;
+	get_args( argc, argv );
 
-		switch ( iev.code )
-		{
-			case BTN_LEFT:		i = 0; break;
-			case BTN_MIDDLE:	i = 1; break;
-			case BTN_RIGHT:		i = 2; break;
-				break;
-			default:
-				continue;
-				break;
-		}
+	fprintf( stderr, "Initializing mouse interface...\n" );
 
-		snd_seq_ev_clear( &ev );
+	/* masked when it turns up, if it isn't there yet */
+	if ( -1 != open_driver_input( &mouse_driver, &input, device, INPUT_GRAB ) &&
+		 ! mouse_driver.opts.replay_file )
+		mask_events();
 
-		switch ( ev.type = map[i].ev_type )
-		{
-			case SND_SEQ_EVENT_CONTROLLER:
+	port = open_driver_port( &mouse_driver );
 
-				snd_seq_ev_set_controller( &ev, map[i].channel,
-												map[i].number,
-												iev.value == DOWN ? 127 : 0 );
-				break;
+	for ( i = 0; i < elementsof( map ); i++ )
+		event_template( &map[i].ev, port, map[i].ev_type, map[i].channel,
+						map[i].number, 0 );
 
-			case SND_SEQ_EVENT_NOTEON:
-				
-				snd_seq_ev_set_noteon( &ev, map[i].channel,
-											map[i].number,
-											iev.value == DOWN ? 127 : 0 );
-				break;
+	input.resync = resync_buttons;
+}
 
-			default:
-				fprintf( stderr,
-						 "Internal error: invalid mapping!\n" );
-				continue;
-				break;
-		}
+struct driver_s mouse_driver = {
+	"mouse", CLIENT_NAME, VERSION,
+	mouse_probe, mouse_init, mouse_frame, NULL, NULL, NULL, mouse_attached
+};
 
-		send_event( &ev );
-	}
+#ifdef LSMI_PLUGIN
+struct driver_s *lsmi_driver = &mouse_driver;
+#else
+/** main 
+ *
+ */
+int
+main ( int argc, char **argv )
+{
+	return driver_main( &mouse_driver, argc, argv );
 }
+#endif
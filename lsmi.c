@@ -0,0 +1,299 @@
+/* lsmi.c
+ *
+ * Linux Pseudo MIDI Input -- Host
+ *
+ * Runs any mix of the drivers in a single process, from a single event loop,
+ * as one ALSA Sequencer client with one output port per driver. This saves
+ * having a separate process, client, and realtime thread for every device on
+ * a rig with several controllers.
+ *
+ * Each driver takes the same options it does when run on its own. Drivers
+ * are separated by '--'. Each driver may be run only once.
+ *
+ * Drivers are plugins, loaded from PLUGIN_DIR (or $LSMI_PLUGIN_PATH) as
+ * lsmi-<driver>.so, or from a path given in place of the driver's name. A
+ * plugin exports 'lsmi_driver', pointing to its struct driver_s, and calls
+ * on the host for everything else.
+ *
+ * Example:
+ *
+ * 	Run a mouse pedalboard and the Monterey keyboard together, at realtime
+ * 	priority 90:
+ *
+ * 	lsmi -R 90 mouse -d /dev/input/event4 -1 c:1:64 -- monterey -d /dev/input/event3
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <alsa/asoundlib.h>
+
+#include "seq.h"
+#include "sig.h"
+#include "loop.h"
+
+#define CLIENT_NAME "Pseudo-MIDI Input"
+#define VERSION "0.1"
+
+#ifndef PLUGIN_DIR
+#define PLUGIN_DIR "/usr/local/lib/lsmi"
+#endif
+
+/**
+ * Return the directory drivers are loaded from
+ */
+static const char *
+plugin_dir ( void )
+{
+	const char *dir = getenv( "LSMI_PLUGIN_PATH" );
+
+	return dir ? dir : PLUGIN_DIR;
+}
+
+/**
+ * Load driver /name/, or the plugin at /name/ if it's a path. Returns NULL
+ * if it can't be loaded.
+ */
+static struct driver_s *
+load_driver ( const char *name )
+{
+	char path[ PATH_MAX ];
+	struct driver_s **d;
+	void *h;
+
+	if ( strchr( name, '/' ) )
+		snprintf( path, sizeof( path ), "%s", name );
+	else
+		snprintf( path, sizeof( path ), "%s/lsmi-%s.so", plugin_dir(), name );
+
+	if ( ! ( h = dlopen( path, RTLD_NOW ) ) ||
+		 ! ( d = dlsym( h, "lsmi_driver" ) ) )
+	{
+		fprintf( stderr, "%s\n", dlerror() );
+
+		if ( h )
+			dlclose( h );
+
+		return NULL;
+	}
+
+	return *d;
+}
+
+/**
+ * Call /f/ with the name of each driver in the plugin directory
+ */
+static void
+each_driver ( void (*f)( const char *name, void *arg ), void *arg )
+{
+	struct dirent *de;
+	DIR *dir;
+
+	if ( ! ( dir = opendir( plugin_dir() ) ) )
+		return;
+
+	while ( ( de = readdir( dir ) ) )
+	{
+		char name[ 256 ];
+		int len = strlen( de->d_name );
+
+		if ( strncmp( de->d_name, "lsmi-", 5 ) || len < 9 ||
+			 strcmp( de->d_name + len - 3, ".so" ) )
+			continue;
+
+		snprintf( name, sizeof( name ), "%.*s", len - 8, de->d_name + 5 );
+
+		f( name, arg );
+	}
+
+	closedir( dir );
+}
+
+/**
+ * Print /name/
+ */
+static void
+list_driver ( const char *name, void *arg )
+{
+	fprintf( stderr, " %s\n", name );
+}
+
+/**
+ * Print /name/ if that driver takes the device open on *arg
+ */
+static void
+probe_driver ( const char *name, void *arg )
+{
+	struct driver_s *d;
+
+	if ( ( d = load_driver( name ) ) && d->probe && d->probe( *(int*)arg ) )
+		printf( "%s\n", name );
+}
+
+/** usage
+ *
+ * print help
+ *
+ */
+static void
+usage ( void )
+{
+	fprintf( stderr, "Usage: lsmi [options] driver [driver options] [-- driver [driver options]] ...\n"
+	"Options:\n\n"
+		" -h | --help                   Show this message\n"
+		" -v | --verbose                Be verbose (show note events)\n"
+		" -R | --realtime rtprio        Use realtime priority 'rtprio' (requires privs)\n"
+		" -z | --daemon                 Fork and don't print anything to stdout\n"
+		" -d | --probe specialfile      List the drivers that can drive this device\n"
+	"\nDrivers (in %s):\n\n", plugin_dir() );
+
+	each_driver( list_driver, NULL );
+
+	fprintf( stderr, "\n" );
+}
+
+/** 
+ * process commandline arguments up to the first driver name
+ */
+static void
+get_args ( int argc, char **argv )
+{
+	/* '+' stops at the first non-option, our first driver */
+	const char *short_opts = "+hvR:zd:";
+	const struct option long_opts[] =
+	{
+		{ "help", no_argument, NULL, 'h' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "realtime", required_argument, NULL, 'R' },
+		{ "daemon", no_argument, NULL, 'z' },
+		{ "probe", required_argument, NULL, 'd' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	int c;
+
+	while ( ( c = getopt_long( argc, argv, short_opts, long_opts, NULL ))
+			!= -1 )
+	{
+		switch (c)
+		{
+			case 'h':
+				usage();
+				exit(0);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'R':
+				{
+					struct sched_param sp;
+
+					sp.sched_priority = atoi( optarg );
+
+					if ( sched_setscheduler( 0, SCHED_FIFO, &sp ) < 0 )
+					{
+						perror( "sched_setscheduler()" );
+						fprintf( stderr, "Failed to get realtime priority!\n" );
+						exit( 1 );
+					}
+
+					fprintf( stderr, "Using realtime priority %i.\n", 
+						sp.sched_priority );
+				}
+				break;
+			case 'z':
+				daemonize = 1;
+				break;
+			case 'd':
+				{
+					int fd;
+
+					if ( -1 == ( fd = open( optarg, O_RDONLY ) ) )
+					{
+						perror( optarg );
+						exit( 1 );
+					}
+
+					each_driver( probe_driver, &fd );
+
+					close( fd );
+					exit( 0 );
+				}
+				break;
+			default:
+				usage();
+				exit( 1 );
+		}
+	}
+}
+
+/** main 
+ *
+ */
+int
+main ( int argc, char **argv )
+{
+	int i, n;
+
+	fprintf( stderr, "lsmi" " v" VERSION "\n" );
+
+	get_args( argc, argv );
+
+	if ( optind >= argc )
+	{
+		usage();
+		exit( 1 );
+	}
+
+	client_name = CLIENT_NAME;
+
+	set_traps();
+
+	/* hand each driver its slice of argv, from its name up to the next '--' */
+	for ( i = optind; i < argc; i = n + 1 )
+	{
+		struct driver_s *d;
+
+		for ( n = i; n < argc && strcmp( argv[n], "--" ); n++ )
+			;
+
+		if ( n == i )
+			continue;
+
+		if ( NULL == ( d = load_driver( argv[i] ) ) )
+		{
+			fprintf( stderr, "Unknown driver '%s'!\n", argv[i] );
+			exit( 1 );
+		}
+
+		if ( d->running )
+		{
+			fprintf( stderr, "Driver '%s' may only be run once!\n", d->name );
+			exit( 1 );
+		}
+
+		fprintf( stderr, "Starting %s v%s...\n", d->name, d->version );
+
+		/* name the port after the driver, since they share one client */
+		port_name = d->client_name;
+
+		argv[n] = NULL;
+
+		start_driver( d, n - i, argv + i );
+	}
+
+	run();
+
+	close_client();
+
+	return 0;
+}
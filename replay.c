@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/cdefs.h>
+
+#include <linux/input.h>
+#include <linux/joystick.h>
+#include <alsa/asoundlib.h>
+
+#include "seq.h"
+#include "replay.h"
+#include "sig.h"
+
+/* A recording is an 8 byte header followed by one fixed size record per
+ * input event, each stamped with the microseconds since the previous one. It
+ * is replayed by a child process writing into a pipe, which the driver reads
+ * in place of its device, so everything downstream of read() runs exactly as
+ * it would live. */
+
+#define REC_MAGIC "LSMR"
+#define REC_VERSION 1
+
+struct rec_header_s {
+	char magic[4];
+	uint8_t version;
+	uint8_t kind;
+	uint16_t reserved;
+};
+
+struct rec_evdev_s {
+	uint32_t delta;									/* uS */
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+};
+
+struct rec_js_s {
+	uint32_t delta;									/* uS */
+	int16_t value;
+	uint8_t type;
+	uint8_t number;
+};
+
+struct record_s {
+	int fd;
+	long long last;									/* uS */
+};
+
+/* a driver's replay, timed from its start to the end of its input */
+struct replay_s {
+	pid_t feeder;
+	struct timespec start_wall, start_cpu;
+	struct timespec end_wall, end_cpu;
+	int ended;
+};
+
+int replaying = 0;
+unsigned long events_read = 0;
+
+/**
+ * Return microseconds since the previous recorded event
+ */
+static uint32_t
+rec_delta ( struct record_s *rec, long long us )
+{
+	long long d = rec->last ? us - rec->last : 0;
+
+	rec->last = us;
+
+	return d < 0 ? 0 : d > UINT32_MAX ? UINT32_MAX : d;
+}
+
+/**
+ * Create recording /file/ of events of /kind/
+ */
+struct record_s *
+record_open ( const char *file, int kind )
+{
+	struct rec_header_s h;
+	struct record_s *rec;
+	int fd;
+
+	if ( -1 == ( fd = open( file, O_WRONLY | O_CREAT | O_TRUNC, 0666 ) ) )
+	{
+		fprintf( stderr, "Error creating recording '%s'! (%s)\n", file, strerror( errno ) );
+		return NULL;
+	}
+
+	memcpy( h.magic, REC_MAGIC, 4 );
+	h.version = REC_VERSION;
+	h.kind = kind;
+	h.reserved = 0;
+
+	write( fd, &h, sizeof( h ) );
+
+	rec = calloc( 1, sizeof( *rec ) );
+	rec->fd = fd;
+
+	return rec;
+}
+
+/**
+ * Append /n/ evdev events to recording /rec/
+ */
+void
+record_evdev ( struct record_s *rec, const struct input_event *ev, int n )
+{
+	struct rec_evdev_s r[ 64 ];
+	int i, j = 0;
+
+	for ( i = 0; i < n; i++ )
+	{
+		r[j].delta = rec_delta( rec, ev[i].time.tv_sec * 1000000LL + ev[i].time.tv_usec );
+		r[j].type = ev[i].type;
+		r[j].code = ev[i].code;
+		r[j].value = ev[i].value;
+
+		if ( ++j == 64 || i == n - 1 )
+		{
+			write( rec->fd, r, j * sizeof( r[0] ) );
+			j = 0;
+		}
+	}
+}
+
+/**
+ * Append /n/ joystick events to recording /rec/
+ */
+void
+record_js ( struct record_s *rec, const struct js_event *e, int n )
+{
+	struct rec_js_s r[ 64 ];
+	int i, j = 0;
+
+	for ( i = 0; i < n; i++ )
+	{
+		r[j].delta = rec_delta( rec, e[i].time * 1000LL );
+		r[j].value = e[i].value;
+		r[j].type = e[i].type;
+		r[j].number = e[i].number;
+
+		if ( ++j == 64 || i == n - 1 )
+		{
+			write( rec->fd, r, j * sizeof( r[0] ) );
+			j = 0;
+		}
+	}
+}
+
+/**
+ * Return the clock replayed events of /kind/ are stamped with: what the input
+ * layer falls back to for evdev, as a pipe won't take EVIOCSCLOCKID.
+ */
+static clockid_t
+stamp_clock ( int kind )
+{
+	return kind == REC_EVDEV ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+}
+
+/**
+ * Convert record /r/ of /kind/ into a device event at /out/, stamped /now/.
+ * Returns the size of the device event.
+ */
+static int
+rec_to_event ( int kind, const void *r, void *out, const struct timespec *now )
+{
+	if ( kind == REC_EVDEV )
+	{
+		const struct rec_evdev_s *re = r;
+		struct input_event *ev = out;
+
+		ev->time.tv_sec = now->tv_sec;
+		ev->time.tv_usec = now->tv_nsec / 1000;
+		ev->type = re->type;
+		ev->code = re->code;
+		ev->value = re->value;
+
+		return sizeof( *ev );
+	}
+	else
+	{
+		const struct rec_js_s *rj = r;
+		struct js_event *e = out;
+
+		e->time = now->tv_sec * 1000 + now->tv_nsec / 1000000;
+		e->value = rj->value;
+		e->type = rj->type;
+		e->number = rj->number;
+
+		return sizeof( *e );
+	}
+}
+
+/**
+ * Child side of replay: write records from /f/ as device events to /out/,
+ * either paced as recorded (repeat == 0) or as fast as the reader will take
+ * them, /repeat/ times over.
+ */
+static void
+feed ( FILE *f, int out, int kind, int repeat )
+{
+	size_t rsize = kind == REC_EVDEV ? sizeof( struct rec_evdev_s ) : sizeof( struct rec_js_s );
+	char buf[ 64 * sizeof( struct input_event ) ];
+	struct timespec now;
+	int len = 0;
+
+	if ( ! repeat )
+	{
+		struct rec_evdev_s r;						/* big enough for either */
+		struct timespec due;
+
+		clock_gettime( CLOCK_MONOTONIC, &due );
+
+		while ( fread( &r, rsize, 1, f ) == 1 )
+		{
+			if ( r.delta )
+			{
+				/* everything stamped before now goes out together */
+				if ( len )
+					write( out, buf, len );
+				len = 0;
+
+				due.tv_nsec += r.delta * 1000LL;
+				due.tv_sec += due.tv_nsec / 1000000000;
+				due.tv_nsec %= 1000000000;
+
+				while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL ) == EINTR )
+					;
+			}
+
+			if ( len + sizeof( struct input_event ) > sizeof( buf ) )
+			{
+				write( out, buf, len );
+				len = 0;
+			}
+
+			clock_gettime( stamp_clock( kind ), &now );
+			len += rec_to_event( kind, &r, buf + len, &now );
+		}
+
+		if ( len )
+			write( out, buf, len );
+	}
+	else
+	{
+		char *recs = NULL;
+		size_t n = 0, i;
+
+		/* slurp, so only the reader is measured */
+		for ( ;; )
+		{
+			recs = realloc( recs, ( n + 1024 ) * rsize );
+
+			if ( ( i = fread( recs + n * rsize, rsize, 1024, f ) ) == 0 )
+				break;
+
+			n += i;
+		}
+
+		while ( repeat-- )
+		{
+			clock_gettime( stamp_clock( kind ), &now );
+
+			for ( i = 0; i < n; i++ )
+			{
+				if ( len + sizeof( struct input_event ) > sizeof( buf ) )
+				{
+					if ( write( out, buf, len ) < 0 )
+						return;
+					len = 0;
+					clock_gettime( stamp_clock( kind ), &now );
+				}
+
+				len += rec_to_event( kind, recs + i * rsize, buf + len, &now );
+			}
+		}
+
+		if ( len )
+			write( out, buf, len );
+	}
+}
+
+/**
+ * Return the kind of events recording /file/ holds, or -1 if it isn't a
+ * recording (or can't be read).
+ */
+int
+replay_kind ( const char *file )
+{
+	struct rec_header_s h;
+	FILE *f;
+	int r;
+
+	if ( NULL == ( f = fopen( file, "r" ) ) )
+		return -1;
+
+	r = fread( &h, sizeof( h ), 1, f ) != 1 ||
+		memcmp( h.magic, REC_MAGIC, 4 ) ||
+		h.version != REC_VERSION ? -1 : h.kind;
+
+	fclose( f );
+
+	return r;
+}
+
+/**
+ * Start replaying recording /file/, which must hold events of /kind/, in
+ * real time (if /repeat/ is 0) or as fast as possible /repeat/ times over,
+ * putting the replay in /rp/ for replay_end() and replay_report(). Returns an
+ * fd to read the events from in place of the device, or -1.
+ */
+int
+replay_open ( const char *file, int kind, int repeat, struct replay_s **rp )
+{
+	struct rec_header_s h;
+	struct replay_s *r;
+	pid_t feeder;
+	FILE *f;
+	int p[2];
+
+	if ( NULL == ( f = fopen( file, "r" ) ) )
+	{
+		fprintf( stderr, "Error opening recording '%s'! (%s)\n", file, strerror( errno ) );
+		return -1;
+	}
+
+	if ( fread( &h, sizeof( h ), 1, f ) != 1 ||
+		 memcmp( h.magic, REC_MAGIC, 4 ) ||
+		 h.version != REC_VERSION ||
+		 h.kind != kind )
+	{
+		fprintf( stderr, "'%s' isn't a recording of this kind of device!\n", file );
+		fclose( f );
+		return -1;
+	}
+
+	if ( pipe( p ) < 0 )
+	{
+		perror( "pipe()" );
+		fclose( f );
+		return -1;
+	}
+
+	if ( 0 == ( feeder = fork() ) )
+	{
+		untrap();
+
+		close( p[0] );
+		feed( f, p[1], kind, repeat );
+		_exit( 0 );
+	}
+
+	fclose( f );
+	close( p[1] );
+
+	if ( feeder < 0 )
+	{
+		perror( "fork()" );
+		close( p[0] );
+		return -1;
+	}
+
+	replaying = 1;
+
+	r = *rp = calloc( 1, sizeof( *r ) );
+	r->feeder = feeder;
+
+	clock_gettime( CLOCK_MONOTONIC, &r->start_wall );
+	clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &r->start_cpu );
+
+	return p[0];
+}
+
+/**
+ * The replay /r/ has run out of input: stop its clocks, so shutting down
+ * isn't counted
+ */
+void
+replay_end ( struct replay_s *r )
+{
+	if ( ! r || r->ended )
+		return;
+
+	clock_gettime( CLOCK_MONOTONIC, &r->end_wall );
+	clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &r->end_cpu );
+
+	r->ended = 1;
+}
+
+/**
+ * Print throughput and CPU cost of replay /r/ (of driver /name/), up to the
+ * end of its input or so far, to /fp/
+ */
+void
+replay_report ( struct replay_s *r, const char *name, FILE *fp )
+{
+	struct timespec wall, cpu;
+	double w, c;
+
+	if ( ! r )
+		return;
+
+	if ( r->ended )
+	{
+		wall = r->end_wall;
+		cpu = r->end_cpu;
+	}
+	else
+	{
+		clock_gettime( CLOCK_MONOTONIC, &wall );
+		clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &cpu );
+	}
+
+	if ( r->feeder > 0 && waitpid( r->feeder, NULL, WNOHANG ) == r->feeder )
+		r->feeder = 0;
+
+	w = ( wall.tv_sec - r->start_wall.tv_sec ) + ( wall.tv_nsec - r->start_wall.tv_nsec ) * 1e-9;
+	c = ( cpu.tv_sec - r->start_cpu.tv_sec ) + ( cpu.tv_nsec - r->start_cpu.tv_nsec ) * 1e-9;
+
+	fprintf( fp, "Replayed %lu %s events in %.3f s: %.0f events/s, %.0f nS CPU/event, %lu MIDI events out",
+			 events_read, name, w, w > 0 ? events_read / w : 0,
+			 events_read ? c * 1e9 / events_read : 0, events_sent );
+
+	if ( raw_bytes )
+		fprintf( fp, " (%lu raw MIDI bytes)", raw_bytes );
+
+	fprintf( fp, "\n" );
+}
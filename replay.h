@@ -0,0 +1,20 @@
+
+/* kinds of recording */
+#define REC_EVDEV 1									/* struct input_event */
+#define REC_JS 2									/* struct js_event */
+
+struct input_event;
+struct js_event;
+struct record_s;
+struct replay_s;
+
+extern int replaying;
+extern unsigned long events_read;
+
+struct record_s * record_open __P(( const char *file, int kind ));
+void record_evdev __P(( struct record_s *rec, const struct input_event *ev, int n ));
+void record_js __P(( struct record_s *rec, const struct js_event *e, int n ));
+int replay_kind __P(( const char *file ));
+int replay_open __P(( const char *file, int kind, int repeat, struct replay_s **rp ));
+void replay_end __P(( struct replay_s *r ));
+void replay_report __P(( struct replay_s *r, const char *name, FILE *fp ));
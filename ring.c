@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/cdefs.h>
+
+#include <linux/io_uring.h>
+
+#include "loop.h"
+#include "ring.h"
+
+/* Reads kept armed on an io_uring, for builds with IO_URING=1 (Linux 5.6 or
+ * later, talked to directly rather than through liburing). Every watched fd
+ * always has a read in flight; the ring's fd sits in the main loop's epoll
+ * set, so one wakeup harvests whatever all the devices delivered, and the
+ * reads are re-armed together with a single io_uring_enter() before the loop
+ * waits again. */
+
+#define MAX_RING_READS 32
+#define RING_ENTRIES 64								/* a read and a cancel per fd */
+#define CANCEL_DATA ( ~0ULL )						/* user_data of cancels */
+
+/* a watched fd */
+struct ring_read_s {
+	int used;										/* until its last read completes */
+	int fd;
+	ring_buf_f buf;
+	ring_f f;										/* NULL once unwatched */
+	void *arg;
+	int armed;										/* read in flight */
+};
+
+unsigned long ring_enters = 0;
+
+static struct ring_read_s reads[ MAX_RING_READS ];
+static int rfd = -1;
+static unsigned queued = 0;							/* SQEs not yet submitted */
+
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+
+static void ring_reap __P(( int fd, void *arg ));
+
+/**
+ * Set up the ring and map its queues. Returns -1 if the kernel can't.
+ */
+static int
+ring_init ( void )
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset( &p, 0, sizeof( p ) );
+
+	if ( ( rfd = syscall( __NR_io_uring_setup, RING_ENTRIES, &p ) ) < 0 )
+		return -1;
+
+	sq = mmap( NULL, p.sq_off.array + p.sq_entries * sizeof( unsigned ),
+			   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING );
+	cq = mmap( NULL, p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe ),
+			   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING );
+	sqes = mmap( NULL, p.sq_entries * sizeof( struct io_uring_sqe ),
+				 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES );
+
+	if ( sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+		 watch_fd( rfd, ring_reap, NULL ) < 0 )
+	{
+		close( rfd );
+		rfd = -1;
+		return -1;
+	}
+
+	sq_head = (unsigned *)( sq + p.sq_off.head );
+	sq_tail = (unsigned *)( sq + p.sq_off.tail );
+	sq_mask = (unsigned *)( sq + p.sq_off.ring_mask );
+	sq_array = (unsigned *)( sq + p.sq_off.array );
+
+	cq_head = (unsigned *)( cq + p.cq_off.head );
+	cq_tail = (unsigned *)( cq + p.cq_off.tail );
+	cq_mask = (unsigned *)( cq + p.cq_off.ring_mask );
+	cqes = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+
+	return 0;
+}
+
+/**
+ * Queue /sqe/ for the next io_uring_enter(). Returns -1 if the queue is full.
+ */
+static int
+ring_push ( struct io_uring_sqe *sqe )
+{
+	unsigned tail = *sq_tail;
+	unsigned i;
+
+	if ( tail - __atomic_load_n( sq_head, __ATOMIC_ACQUIRE ) > *sq_mask )
+		return -1;
+
+	i = tail & *sq_mask;
+
+	sqes[ i ] = *sqe;
+	sq_array[ i ] = i;
+
+	__atomic_store_n( sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+	queued++;
+
+	return 0;
+}
+
+/**
+ * Hand the kernel whatever has been queued
+ */
+static void
+ring_enter ( void )
+{
+	int r;
+
+	if ( ! queued )
+		return;
+
+	ring_enters++;
+
+	if ( ( r = syscall( __NR_io_uring_enter, rfd, queued, 0, 0, NULL, 0 ) ) < 0 )
+	{
+		/* try again next time around */
+		if ( errno != EINTR && errno != EAGAIN && errno != EBUSY )
+			perror( "io_uring_enter()" );
+		return;
+	}
+
+	queued -= r;
+}
+
+/**
+ * Call /f/ with /arg/ each time a read from /fd/ completes, reading to where
+ * /buf/ says. Reads are armed by ring_submit(), so the fd can still be read
+ * directly until the main loop starts. Returns -1 if there's no ring to be
+ * had, so the caller can fall back to watch_fd().
+ */
+int
+ring_watch ( int fd, ring_buf_f buf, ring_f f, void *arg )
+{
+	int i;
+
+	if ( rfd < 0 && ring_init() < 0 )
+		return -1;
+
+	for ( i = 0; i < MAX_RING_READS; i++ )
+		if ( ! reads[i].used )
+			break;
+
+	if ( i == MAX_RING_READS )
+		return -1;
+
+	reads[i].used = 1;
+	reads[i].fd = fd;
+	reads[i].buf = buf;
+	reads[i].f = f;
+	reads[i].arg = arg;
+	reads[i].armed = 0;
+
+	return 0;
+}
+
+/**
+ * Stop reading /fd/, cancelling its read if one is in flight. Safe to call
+ * from within a ring_f.
+ */
+void
+ring_unwatch ( int fd )
+{
+	struct io_uring_sqe sqe;
+	int i;
+
+	for ( i = 0; i < MAX_RING_READS; i++ )
+		if ( reads[i].used && reads[i].f && reads[i].fd == fd )
+			break;
+
+	if ( i == MAX_RING_READS )
+		return;
+
+	reads[i].f = NULL;
+
+	if ( ! reads[i].armed )
+	{
+		reads[i].used = 0;
+		return;
+	}
+
+	/* the slot is freed when the read comes back cancelled */
+	memset( &sqe, 0, sizeof( sqe ) );
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.addr = i;
+	sqe.user_data = CANCEL_DATA;
+
+	/* before the caller closes the fd */
+	if ( ring_push( &sqe ) == 0 )
+		ring_enter();
+}
+
+/**
+ * Arm a read on every watched fd that hasn't one in flight, and submit them
+ * all at once. Called by the main loop before it waits.
+ */
+void
+ring_submit ( void )
+{
+	struct io_uring_sqe sqe;
+	size_t len;
+	int i;
+
+	if ( rfd < 0 )
+		return;
+
+	for ( i = 0; i < MAX_RING_READS; i++ )
+	{
+		if ( ! reads[i].f || reads[i].armed )
+			continue;
+
+		memset( &sqe, 0, sizeof( sqe ) );
+		sqe.opcode = IORING_OP_READ;
+		sqe.fd = reads[i].fd;
+		sqe.addr = (unsigned long)reads[i].buf( reads[i].arg, &len );
+		sqe.len = len;
+		sqe.off = -1;								/* current position */
+		sqe.user_data = i;
+
+		if ( ring_push( &sqe ) < 0 )
+			break;
+
+		reads[i].armed = 1;
+	}
+
+	ring_enter();
+}
+
+/**
+ * Pass on each completed read. The ring's fd is readable while there are any.
+ */
+static void
+ring_reap ( int fd, void *arg )
+{
+	unsigned head = *cq_head;
+
+	while ( head != __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE ) )
+	{
+		struct io_uring_cqe *cqe = &cqes[ head & *cq_mask ];
+		unsigned long long data = cqe->user_data;
+		int res = cqe->res;
+		struct ring_read_s *r;
+
+		/* release the entry first, the callback may queue more */
+		__atomic_store_n( cq_head, ++head, __ATOMIC_RELEASE );
+
+		if ( data == CANCEL_DATA )
+			continue;
+
+		r = &reads[ data ];
+		r->armed = 0;
+
+		if ( ! r->f )
+		{
+			/* unwatched while in flight */
+			r->used = 0;
+			continue;
+		}
+
+		r->f( res, r->arg );
+	}
+}
@@ -0,0 +1,11 @@
+
+/* where to read to, with its size in /len/ */
+typedef void *(*ring_buf_f) __P(( void *arg, size_t *len ));
+/* a read finished, with read()'s result (or -errno) */
+typedef void (*ring_f) __P(( int res, void *arg ));
+
+extern unsigned long ring_enters;
+
+int ring_watch __P(( int fd, ring_buf_f buf, ring_f f, void *arg ));
+void ring_unwatch __P(( int fd ));
+void ring_submit __P(( void ));
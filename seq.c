@@ -2,11 +2,44 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <time.h>
 #include <alsa/asoundlib.h>
 
-extern snd_seq_t *seq;
-extern int port;
-extern int verbose;
+#include "lat.h"
+#include "log.h"
+
+snd_seq_t *seq = NULL;								/* our one client */
+const char *client_name = "Pseudo-MIDI Input";
+int verbose = 0;
+
+unsigned long events_sent = 0;
+unsigned long raw_bytes = 0;						/* written to rawmidi devices */
+
+static int buffered = 0;
+static int null_output = 0;
+static int null_ports = 0;
+
+#define MAX_RAW 8
+#define RAW_PORT 255								/* rawmidi ports count down from here */
+
+/* a rawmidi device, standing in for a sequencer port */
+struct raw_s {
+	snd_rawmidi_t *out;								/* or NULL, when discarding output */
+	unsigned char status;							/* last status byte written */
+	int len;										/* bytes in buf */
+	unsigned char buf[ 256 ];
+};
+
+static struct raw_s raws[ MAX_RAW ];
+static int nraws = 0;
+
+/* scheduled output */
+static int queue = -1;
+static int latency[ 256 ];							/* uS after input, by port (+1, 0 = direct) */
+static long long queue_base;						/* CLOCK_MONOTONIC uS at queue time 0 */
+static long long queue_synced;						/* when queue_base was last checked */
+static snd_seq_queue_status_t *queue_status;
 
 /** 
  * register client with ALSA
@@ -24,28 +57,373 @@ open_client ( const char *name )
 }
 
 /**
- * Open an output port and return the ID
+ * Count events instead of sending them anywhere; no ALSA client is opened.
+ * For replaying recorded input.
+ */
+void
+discard_output ( void )
+{
+	null_output = 1;
+}
+
+/**
+ * Open an output port named /name/ and return the ID. The client is
+ * registered (as client_name) along with the first port.
  */
 int
-open_output_port ( snd_seq_t *handle )
+open_output_port ( const char *name )
 {
-	return snd_seq_create_simple_port( handle, "Output",
+	if ( null_output )
+		return null_ports++;
+
+	if ( ! seq && NULL == ( seq = open_client( client_name ) ) )
+	{
+		fprintf( stderr, "Error opening alsa sequencer!\n" );
+		return -1;
+	}
+
+	return snd_seq_create_simple_port( seq, name,
 			   SND_SEQ_PORT_CAP_READ |
 			   SND_SEQ_PORT_CAP_SUBS_READ,
 			   SND_SEQ_PORT_TYPE_MIDI_GENERIC |
 			   SND_SEQ_PORT_TYPE_APPLICATION );
 }
 
-/** 
- * Send sequencer event pointed to by /ev/ to open port without delay.
+/**
+ * Open rawmidi device /device/ (e.g. hw:1,0) for output in place of a
+ * sequencer port, bypassing the sequencer. Events sent from the port ID
+ * returned are encoded as MIDI bytes and written straight to the device.
+ * Returns -1 on error.
+ */
+int
+open_rawmidi_port ( const char *device )
+{
+	struct raw_s *r;
+	int err;
+
+	if ( nraws == MAX_RAW )
+	{
+		fprintf( stderr, "Too many rawmidi devices!\n" );
+		return -1;
+	}
+
+	r = &raws[ nraws ];
+	memset( r, 0, sizeof( *r ) );
+
+	/* still encoded, but not written, when discarding output */
+	if ( ! null_output &&
+		 ( err = snd_rawmidi_open( NULL, &r->out, device, 0 ) ) < 0 )
+	{
+		fprintf( stderr, "Error opening rawmidi device '%s'! (%s)\n", device, snd_strerror( err ) );
+		return -1;
+	}
+
+	return RAW_PORT - nraws++;
+}
+
+/**
+ * Return the rawmidi device behind /port/, or NULL if it's a sequencer port
+ */
+static struct raw_s *
+raw_port ( int port )
+{
+	return RAW_PORT - port < nraws ? &raws[ RAW_PORT - port ] : NULL;
+}
+
+/**
+ * Write whatever bytes /r/ has queued
+ */
+static void
+raw_flush ( struct raw_s *r )
+{
+	if ( ! r->len )
+		return;
+
+	if ( r->out && snd_rawmidi_write( r->out, r->buf, r->len ) < 0 )
+		log_msg( stderr, "Error writing to rawmidi device!\n", 0, 0 );
+
+	raw_bytes += r->len;
+	r->len = 0;
+}
+
+/**
+ * Encode event /ev/ as MIDI bytes for /r/, leaving out the status byte when
+ * it's the same as the last one (running status)
+ */
+static void
+raw_output ( struct raw_s *r, const snd_seq_event_t *ev )
+{
+	unsigned char b[3];
+	int n = 0;
+	int v;
+
+	switch ( ev->type )
+	{
+		case SND_SEQ_EVENT_NOTEON:
+			b[n++] = 0x90 | ( ev->data.note.channel & 0x0F );
+			b[n++] = ev->data.note.note & 0x7F;
+			b[n++] = ev->data.note.velocity & 0x7F;
+			break;
+		case SND_SEQ_EVENT_NOTEOFF:
+			b[n++] = 0x80 | ( ev->data.note.channel & 0x0F );
+			b[n++] = ev->data.note.note & 0x7F;
+			b[n++] = ev->data.note.velocity & 0x7F;
+
+			/* in the middle of note ons, a note on of velocity 0 does
+			 * just as well and saves the status byte */
+			if ( r->status == ( b[0] | 0x10 ) )
+			{
+				b[0] |= 0x10;
+				b[2] = 0;
+			}
+			break;
+		case SND_SEQ_EVENT_CONTROLLER:
+			b[n++] = 0xB0 | ( ev->data.control.channel & 0x0F );
+			b[n++] = ev->data.control.param & 0x7F;
+			b[n++] = ev->data.control.value & 0x7F;
+			break;
+		case SND_SEQ_EVENT_PGMCHANGE:
+			b[n++] = 0xC0 | ( ev->data.control.channel & 0x0F );
+			b[n++] = ev->data.control.value & 0x7F;
+			break;
+		case SND_SEQ_EVENT_PITCHBEND:
+			v = ev->data.control.value + 8192;
+			b[n++] = 0xE0 | ( ev->data.control.channel & 0x0F );
+			b[n++] = v & 0x7F;
+			b[n++] = ( v >> 7 ) & 0x7F;
+			break;
+		default:
+			return;
+	}
+
+	if ( r->len + n > sizeof( r->buf ) )
+		raw_flush( r );
+
+	if ( b[0] != r->status )
+		r->buf[ r->len++ ] = r->status = b[0];
+
+	memcpy( r->buf + r->len, b + 1, n - 1 );
+	r->len += n - 1;
+
+	if ( ! buffered )
+		raw_flush( r );
+}
+
+/**
+ * Return CLOCK_MONOTONIC in uS
+ */
+static long long
+now_us ( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Find where the queue's clock stands against CLOCK_MONOTONIC, so as to
+ * follow any drift between the two
+ */
+static void
+sync_queue ( void )
+{
+	const snd_seq_real_time_t *rt;
+	long long now = now_us();
+
+	queue_synced = now;
+
+	if ( snd_seq_get_queue_status( seq, queue, queue_status ) < 0 )
+		return;
+
+	rt = snd_seq_queue_status_get_real_time( queue_status );
+
+	queue_base = now - ( rt->tv_sec * 1000000LL + rt->tv_nsec / 1000 );
+}
+
+/**
+ * Schedule events sent from /port/ on a queue, to be delivered /latency_us/ uS
+ * after the kernel's timestamp on the input that produced them, instead of
+ * as soon as they're sent. So long as that's longer than it takes to get
+ * from the input to sending the event, the latency is constant, whatever
+ * jitter comes before. Events already late go out at once. Returns -1 if the
+ * queue couldn't be set up.
+ */
+int
+schedule_port ( int port, int latency_us )
+{
+	if ( null_output || raw_port( port ) )
+		return 0;
+
+	if ( queue < 0 )
+	{
+		if ( ( queue = snd_seq_alloc_named_queue( seq, client_name ) ) < 0 ||
+			 snd_seq_queue_status_malloc( &queue_status ) < 0 )
+		{
+			fprintf( stderr, "Error allocating queue!\n" );
+			queue = -1;
+			return -1;
+		}
+
+		snd_seq_start_queue( seq, queue, NULL );
+		snd_seq_drain_output( seq );
+
+		sync_queue();
+	}
+
+	latency[ port ] = latency_us + 1;
+
+	return 0;
+}
+
+/**
+ * Schedule /ev/ the latency of its port after the current input's timestamp
+ */
+static void
+schedule_event ( snd_seq_event_t *ev )
+{
+	snd_seq_real_time_t rt;
+	long long now = now_us();
+	long long age = lat_age();
+	long long t;
+
+	if ( now - queue_synced >= 1000000 )
+		sync_queue();
+
+	t = now - queue_base + latency[ ev->source.port ] - 1;
+
+	if ( age > 0 )
+		t -= age;
+
+	if ( t < 0 )
+		t = 0;
+
+	rt.tv_sec = t / 1000000;
+	rt.tv_nsec = ( t % 1000000 ) * 1000;
+
+	snd_seq_ev_schedule_real( ev, queue, 0, &rt );
+}
+
+/**
+ * Connect /port/ to the ALSA Sequencer client:port named /name/. Returns -1
+ * if the subscription couldn't be made.
+ */
+int
+connect_port ( int port, const char *name )
+{
+	snd_seq_addr_t addr;
+
+	if ( null_output )
+		return 0;
+
+	if ( snd_seq_parse_address( seq, &addr, name ) < 0 )
+		fprintf( stderr, "Couldn't parse address '%s'", name );
+	else
+	if ( snd_seq_connect_to( seq, port, addr.client, addr.port ) < 0 )
+	{
+		fprintf( stderr, "Error creating subscription for port %i:%i", addr.client, addr.port );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Queue events in an output buffer of /size/ bytes (the library default if
+ * /size/ is 0) until flush_events() is called, instead of writing each one to
+ * the sequencer as it is sent.
+ */
+int
+buffer_output ( int size )
+{
+	buffered = 1;
+
+	if ( seq && size > 0 )
+		return snd_seq_set_output_buffer_size( seq, size );
+
+	return 0;
+}
+
+/**
+ * Write any queued events to the sequencer. Call once per input frame.
  */
 void
-send_event ( snd_seq_event_t *ev )
+flush_events ( void )
 {
-		snd_seq_ev_set_direct( ev );
-		snd_seq_ev_set_source( ev, port );
-		snd_seq_ev_set_subs( ev );
-		snd_seq_event_output_direct( seq, ev );
+	int i;
+
+	if ( buffered && seq )
+		snd_seq_drain_output( seq );
+
+	for ( i = 0; i < nraws; i++ )
+		raw_flush( &raws[i] );
+}
+
+/**
+ * Release the client, if one was opened
+ */
+void
+close_client ( void )
+{
+	int i;
+
+	for ( i = 0; i < nraws; i++ )
+		if ( raws[i].out )
+		{
+			raw_flush( &raws[i] );
+			snd_rawmidi_drain( raws[i].out );
+			snd_rawmidi_close( raws[i].out );
+			raws[i].out = NULL;
+		}
+
+	if ( seq )
+	{
+		snd_seq_close( seq );
+		seq = NULL;
+	}
+}
+
+/**
+ * Output event /ev/, already addressed, and account for it
+ */
+static void
+output_event ( snd_seq_event_t *ev )
+{
+		struct raw_s *r;
+
+		events_sent++;
+
+		if ( nraws && ( r = raw_port( ev->source.port ) ) )
+			raw_output( r, ev );
+		else
+		if ( null_output )
+			;
+		else
+		{
+			if ( latency[ ev->source.port ] )
+				schedule_event( ev );
+
+			if ( buffered )
+				snd_seq_event_output( seq, ev );
+			else
+				snd_seq_event_output_direct( seq, ev );
+		}
+
+		switch ( ev->type )
+		{
+			case SND_SEQ_EVENT_NOTEON:
+			case SND_SEQ_EVENT_NOTEOFF:
+				lat_record( LAT_NOTE );
+				break;
+			case SND_SEQ_EVENT_CONTROLLER:
+			case SND_SEQ_EVENT_PITCHBEND:
+				lat_record( LAT_CC );
+				break;
+			case SND_SEQ_EVENT_PGMCHANGE:
+				lat_record( LAT_PGM );
+				break;
+		}
 
 		if ( verbose == 1 ) 
 		{	
@@ -54,24 +432,131 @@ send_event ( snd_seq_event_t *ev )
 				case SND_SEQ_EVENT_NOTEON:
 					if ( ev->data.note.velocity )
 					{
-						printf( "Note On: %i..%i\n",
-								ev->data.note.note, ev->data.note.velocity );
+						log_msg( stdout, "Note On: %i..%i\n",
+								 ev->data.note.note, ev->data.note.velocity );
 
 						break;
 					}
 				case SND_SEQ_EVENT_NOTEOFF:
-					printf( "Note Off: %i\n", ev->data.note.note );
+					log_msg( stdout, "Note Off: %i\n", ev->data.note.note, 0 );
 					break;
 				case SND_SEQ_EVENT_CONTROLLER:
-					printf( "Conntrol Change: %i:%i\n",
-							ev->data.control.param, ev->data.control.value );
+					log_msg( stdout, "Conntrol Change: %i:%i\n",
+							 ev->data.control.param, ev->data.control.value );
 					break;
 				case SND_SEQ_EVENT_PGMCHANGE:
-					printf( "Program Change: %i\n", ev->data.control.value );
+					log_msg( stdout, "Program Change: %i\n", ev->data.control.value, 0 );
 					break;
 					
 			}
 		}
 }
 
+/** 
+ * Send sequencer event pointed to by /ev/ from /port/ without delay (or, in
+ * buffered mode, with the next flush).
+ */
+void
+send_event ( int port, snd_seq_event_t *ev )
+{
+		snd_seq_ev_set_direct( ev );
+		snd_seq_ev_set_source( ev, port );
+		snd_seq_ev_set_subs( ev );
+
+		output_event( ev );
+}
+
+/**
+ * Silence everything /port/ might have left sounding, on every channel:
+ * controllers are reset (letting go of the sustain pedal) and all notes
+ * turned off. With /now/, at once and no longer scheduling the port, for
+ * shutting down; otherwise after whatever is already scheduled.
+ */
+void
+all_notes_off ( int port, int now )
+{
+	snd_seq_event_t ev;
+	int i;
+
+	if ( now && ! raw_port( port ) )
+		latency[ port ] = 0;
+
+	for ( i = 0; i < 16; i++ )
+	{
+		snd_seq_ev_clear( &ev );
+		snd_seq_ev_set_controller( &ev, i, 121, 0 );
+
+		send_event( port, &ev );
+
+		snd_seq_ev_clear( &ev );
+		snd_seq_ev_set_controller( &ev, i, 123, 0 );
+
+		send_event( port, &ev );
+	}
+
+	flush_events();
+}
+
+/**
+ * Prepare /ev/ as a complete event to be sent from /port/ with
+ * send_template() or send_value(): a note (on or off) of /number/, controller
+ * /number/, program change or pitchbend on /channel/, with /value/ as its
+ * velocity or value. Done once when a mapping is set up, so that sending it
+ * is no more than a copy into the output buffer.
+ */
+void
+event_template ( snd_seq_event_t *ev, int port, int type, int channel, int number, int value )
+{
+	snd_seq_ev_clear( ev );
+
+	switch ( ev->type = type )
+	{
+		case SND_SEQ_EVENT_NOTEON:
+		case SND_SEQ_EVENT_NOTEOFF:
+			snd_seq_ev_set_fixed( ev );
+			ev->data.note.channel = channel;
+			ev->data.note.note = number;
+			ev->data.note.velocity = value;
+			break;
+
+		default:
+			snd_seq_ev_set_fixed( ev );
+			ev->data.control.channel = channel;
+			ev->data.control.param = number;
+			ev->data.control.value = value;
+			break;
+	}
+
+	snd_seq_ev_set_direct( ev );
+	snd_seq_ev_set_source( ev, port );
+	snd_seq_ev_set_subs( ev );
+}
+
+/**
+ * Send event template /ev/ as it stands. A copy goes out, so scheduling it
+ * doesn't leave the template scheduled once the port no longer is.
+ */
+void
+send_template ( snd_seq_event_t *ev )
+{
+	snd_seq_event_t e = *ev;
+
+	output_event( &e );
+}
 
+/**
+ * Send event template /ev/ with its velocity or value set to /value/
+ */
+void
+send_value ( snd_seq_event_t *ev, int value )
+{
+	snd_seq_event_t e = *ev;
+
+	if ( e.type == SND_SEQ_EVENT_NOTEON ||
+		 e.type == SND_SEQ_EVENT_NOTEOFF )
+		e.data.note.velocity = value;
+	else
+		e.data.control.value = value;
+
+	output_event( &e );
+}
@@ -1,5 +1,20 @@
+extern snd_seq_t *seq;
+extern const char *client_name;
+extern int verbose;
+extern unsigned long events_sent;
+extern unsigned long raw_bytes;
 
 snd_seq_t * open_client __P(( const char *name ));
-int open_output_port __P(( snd_seq_t *handle ));
-void send_event __P(( snd_seq_event_t *ev ));
-
+void discard_output __P(( void ));
+int open_output_port __P(( const char *name ));
+int open_rawmidi_port __P(( const char *device ));
+int schedule_port __P(( int port, int latency ));
+int connect_port __P(( int port, const char *name ));
+int buffer_output __P(( int size ));
+void flush_events __P(( void ));
+void close_client __P(( void ));
+void send_event __P(( int port, snd_seq_event_t *ev ));
+void all_notes_off __P(( int port, int now ));
+void event_template __P(( snd_seq_event_t *ev, int port, int type, int channel, int number, int value ));
+void send_template __P(( snd_seq_event_t *ev ));
+void send_value __P(( snd_seq_event_t *ev, int value ));
@@ -1,37 +1,119 @@
 
 #include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/cdefs.h>
 
-void die __P(( int sig ));
+#include "loop.h"
+#include "sig.h"
+
+static int sfd = -1;
+
+/* the signals we take through sfd rather than a handler */
+static const int trapped[] = { SIGINT, SIGQUIT, SIGTERM, SIGHUP, SIGUSR1, SIGUSR2 };
+
+/**
+ * The set of signals in trapped[]
+ */
+static void
+trapped_set ( sigset_t *set )
+{
+	unsigned int i;
+
+	sigemptyset( set );
+
+	for ( i = 0; i < sizeof( trapped ) / sizeof( trapped[0] ); i++ )
+		sigaddset( set, trapped[i] );
+}
+
+/**
+ * Act on whatever signals are pending on /fd/. SIGUSR1 prints the same
+ * reports as exiting does, the rest shut down.
+ */
+static void
+take_signals ( int fd, void *arg )
+{
+	struct signalfd_siginfo si;
+
+	while ( read( fd, &si, sizeof( si ) ) == sizeof( si ) )
+	{
+		if ( si.ssi_signo == SIGUSR1 )
+			reports( stderr );
+		else
+			die( si.ssi_signo );
+	}
+}
 
 /*
- * Handle signals 
+ * Handle signals. They're blocked and read from a signalfd in the main loop,
+ * so die() runs in normal context, between frames, never mid-send.
+ * Faults keep their default action.
  */
 void
 set_traps ( void )
 {
-	signal( SIGINT, die );
-	signal( SIGQUIT, die );
-	signal( SIGILL, die );
-	signal( SIGTRAP, die );
-	signal( SIGABRT, die );
-	signal( SIGIOT, die );
-	signal( SIGFPE, die );
-	signal( SIGKILL, die );
-	signal( SIGUSR1, die );
-	signal( SIGSEGV, die );
-	signal( SIGUSR2, die );
-	signal( SIGPIPE, die );
-	signal( SIGTERM, die );
-	#ifdef SIGSTKFLT
-	signal( SIGSTKFLT, die );
-	#endif
-	signal( SIGCHLD, die );
-	signal( SIGCONT, die );
-	signal( SIGSTOP, die );
-	signal( SIGTSTP, die );
-	signal( SIGTTIN, die );
-	signal( SIGTTOU, die );
+	sigset_t set;
+
+	trapped_set( &set );
+
+	if ( sigprocmask( SIG_BLOCK, &set, NULL ) < 0 ||
+		 ( sfd = signalfd( -1, &set, SFD_NONBLOCK | SFD_CLOEXEC ) ) < 0 )
+	{
+		perror( "signalfd()" );
+		return;
+	}
+
+	/* a subscriber going away shows up as an error, not a signal */
+	signal( SIGPIPE, SIG_IGN );
+
+	if ( watch_fd( sfd, take_signals, NULL ) < 0 )
+		fprintf( stderr, "Error watching for signals!\n" );
+}
+
+/**
+ * Undo set_traps() in a forked child, before it does anything of its own.
+ */
+void
+untrap ( void )
+{
+	sigset_t set;
+
+	signal( SIGPIPE, SIG_DFL );
+
+	trapped_set( &set );
+	sigprocmask( SIG_UNBLOCK, &set, NULL );
 }
 
+/**
+ * Block until /fd/ is readable, taking signals as they come in, for reads made
+ * outside the main loop. Returns -1 on error.
+ */
+int
+wait_readable ( int fd )
+{
+	struct pollfd p[2];
+
+	p[0].fd = fd;
+	p[0].events = POLLIN;
+	p[1].fd = sfd;
+	p[1].events = POLLIN;
 
+	for ( ;; )
+	{
+		if ( poll( p, sfd < 0 ? 1 : 2, -1 ) < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			return -1;
+		}
+
+		if ( sfd >= 0 && p[1].revents )
+			take_signals( sfd, NULL );
+
+		if ( p[0].revents )
+			return 0;
+	}
+}
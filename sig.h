@@ -1,2 +1,5 @@
+
 void set_traps __P(( void ));
+void untrap __P(( void ));
+int wait_readable __P(( int fd ));
 void die __P(( int sig ));